@@ -1,13 +1,16 @@
 #include "accel.hpp"
+#include "convert.hpp"
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
 
-static enum AVPixelFormat hwPixFmt;
-
-static enum AVPixelFormat getHwFormat(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
+enum AVPixelFormat VAccel::getHwFormat(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
 {
     const enum AVPixelFormat *p;
+    VAccel *accel = (VAccel*)ctx->opaque;
 
     for (p = pix_fmts; *p != -1; p++) {
-        if (*p == hwPixFmt)
+        if (*p == accel->hwPixFmt_)
             return *p;
     }
 
@@ -22,23 +25,118 @@ VAccel::VAccel(const char* inf, const char* outf, const char* type) :
 {
 }
 
+VAccel::VAccel(VInput* input, const char* type) :
+    infile_(input->getName()),
+    outfile_("out.yuv"),
+    vatype_(type),
+    input_(input)
+{
+}
+
 VAccel::~VAccel()
 {
+    stopPipeline();
+    avcodec_free_context(&decoderCtx_);
+    avformat_close_input(&inputCtx_);
+    av_buffer_unref(&hwDeviceCtx_);
 }
 
-int VAccel::init()
+int VAccel::init(const VAccelOptions& opts)
 {
-    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+    opts_ = opts;
+    sw_ = !strcmp(vatype_, "sw");
 
-    type = av_hwdevice_find_type_by_name(vatype_);
-    if (type == AV_HWDEVICE_TYPE_NONE)
+    if (openInput() < 0)
+        return -1;
+
+    if (!(decoderCtx_ = avcodec_alloc_context3(decoder_)))
+        return AVERROR(ENOMEM);
+
+    video_ = inputCtx_->streams[stream_];
+    if (avcodec_parameters_to_context(decoderCtx_, video_->codecpar) < 0)
+        return -1;
+
+    if (opts_.sampling == VSAMPLE_KEYFRAMES)
+        decoderCtx_->skip_frame = AVDISCARD_NONKEY;
+
+    if (!sw_ && initHw() < 0) {
+        if (!opts_.swFallback)
+            return -1;
+        fprintf(stderr, "Falling back to software decoding\n");
+        hwPixFmt_ = AV_PIX_FMT_NONE;
+        av_buffer_unref(&decoderCtx_->hw_device_ctx);
+        av_buffer_unref(&hwDeviceCtx_);
+        decoderCtx_->get_format = avcodec_default_get_format;
+        sw_ = true;
+    }
+    if (sw_)
+        initSw();
+    if (opts_.fast)
+        initFast();
+
+    if (opts_.outWidth > 0 || opts_.outHeight > 0 || opts_.crop.width > 0 || opts_.outFormat) {
+        filter_.reset(new VFilter(opts_.outWidth, opts_.outHeight,
+                                  opts_.crop.width > 0 ? &opts_.crop : nullptr, opts_.outFormat));
+        filter_->setExtraHwFrames(opts_.extraSurfaces + (opts_.pipelined ? opts_.queueDepth + 1 : 0));
+    }
+
+    if (avcodec_open2(decoderCtx_, decoder_, NULL) < 0) {
+        fprintf(stderr, "Failed to open codec for stream #%u\n", stream_);
         return -1;
+    }
 
-    if ( avformat_open_input(&inputCtx_, infile_, nullptr, nullptr) != 0) {
+    map_ = !opts_.rois.empty();
+    if (opts_.dedupThreshold > 0)
+        dedup_.reset(new VDedup(opts_.dedupThreshold));
+    if (opts_.cache)
+        initCache();
+    if (opts_.shard)
+        initShard();
+
+    if (opts_.pipelined)
+        return startPipeline();
+
+    return 0;
+}
+
+int VAccel::openInput()
+{
+    struct stat st;
+    VStreamInfo info;
+    std::vector<uint8_t> extradata;
+    AVInputFormat *fmt = nullptr;
+    bool cached = false, known = false;
+
+    if (!(inputCtx_ = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+    if (input_) {
+        if (input_->open() < 0)
+            return -1;
+        inputCtx_->pb = input_->getContext();
+        inputCtx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    if (opts_.probeSize > 0)
+        inputCtx_->probesize = opts_.probeSize;
+    if (opts_.analyzeDuration > 0)
+        inputCtx_->max_analyze_duration = opts_.analyzeDuration;
+
+    /* a catalogue hit names the demuxer, so the input is not probed either */
+    known = opts_.catalog && !input_ && stat(infile_, &st) == 0;
+    if (known && opts_.catalog->find(infile_, st.st_size, st.st_mtime, &info, &extradata))
+        cached = (fmt = av_find_input_format(info.format)) != nullptr;
+
+    if ( avformat_open_input(&inputCtx_, input_ ? nullptr : infile_, fmt, nullptr) != 0) {
         fprintf(stderr, "Cannot open input file %s\n", infile_);
         return -1;
     }
 
+    if (cached && VCatalog::apply(inputCtx_, info, extradata) == 0) {
+        stream_ = info.stream;
+        decoder_ = avcodec_find_decoder((AVCodecID)info.codecId);
+        if (decoder_)
+            return 0;
+    }
+
     if (avformat_find_stream_info(inputCtx_, NULL) < 0) {
         fprintf(stderr, "Cannot find input stream information.\n");
         return -1;
@@ -50,6 +148,22 @@ int VAccel::init()
         return -1;
     }
 
+    if (known && VCatalog::capture(inputCtx_, stream_, &info, &extradata) == 0)
+        opts_.catalog->add(infile_, st.st_size, st.st_mtime, info, extradata);
+
+    return 0;
+}
+
+int VAccel::initHw()
+{
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+
+    type = av_hwdevice_find_type_by_name(vatype_);
+    if (type == AV_HWDEVICE_TYPE_NONE) {
+        fprintf(stderr, "Device type %s is not supported.\n", vatype_);
+        return -1;
+    }
+
     for (int i = 0; true; i++) {
         const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_, i);
         if (!config) {
@@ -59,153 +173,910 @@ int VAccel::init()
         }
         if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
             config->device_type == type) {
-            hwPixFmt = config->pix_fmt;
+            hwPixFmt_ = config->pix_fmt;
             break;
         }
     }
 
-    if (!(decoderCtx_ = avcodec_alloc_context3(decoder_)))
-        return AVERROR(ENOMEM);
-
-    video_ = inputCtx_->streams[stream_];
-    if (avcodec_parameters_to_context(decoderCtx_, video_->codecpar) < 0)
-        return -1;
-
+    decoderCtx_->opaque = this;
     decoderCtx_->get_format  = getHwFormat;
 
-    if (av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
+    if (opts_.hwDevice) {
+        /* device owned by a VAccelManager, shared with its other streams */
+        if (!(hwDeviceCtx_ = av_buffer_ref(opts_.hwDevice)))
+            return AVERROR(ENOMEM);
+    } else if (av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
         fprintf(stderr, "Failed to create specified HW device.\n");
         return -1;
     }
     decoderCtx_->hw_device_ctx = av_buffer_ref(hwDeviceCtx_);
+    decoderCtx_->extra_hw_frames = opts_.extraSurfaces;
+    if (opts_.pipelined) {
+        /* surfaces parked in the decoded queue and in transfer must not starve the decoder */
+        decoderCtx_->extra_hw_frames += opts_.queueDepth + 1;
+    }
 
-    if (avcodec_open2(decoderCtx_, decoder_, NULL) < 0) {
-        fprintf(stderr, "Failed to open codec for stream #%u\n", stream_);
-        return -1;
+    return 0;
+}
+
+std::string VAccel::getOutputKey()
+{
+    char key[256];
+
+    snprintf(key, sizeof(key), "%dx%d|%d,%d,%dx%d|%s|%d,%d",
+             opts_.outWidth, opts_.outHeight, opts_.crop.x, opts_.crop.y, opts_.crop.width,
+             opts_.crop.height, opts_.outFormat ? opts_.outFormat : "", opts_.fast, opts_.lowres);
+    return key;
+}
+
+void VAccel::initCache()
+{
+    char stamp[64];
+
+    /* the frame to return next must be known without decoding it */
+    if (opts_.pipelined || opts_.sampling == VSAMPLE_KEYFRAMES || dedup_ || opts_.onDevice) {
+        fprintf(stderr, "Frame cache needs a direct, non-dedup host decode of every or every n-th frame, not using it\n");
+        return;
+    }
+
+    /* the name of a custom input does not tell its bytes apart */
+    if (input_ && input_->getKey().empty()) {
+        fprintf(stderr, "Frame cache needs a key for memory and callback inputs (VInput::setKey), not using it\n");
+        return;
+    }
+
+    /* a file rewritten in place is another source, as is the same file read
+       with other output options */
+    if (statInput(&srcSize_, &srcMtime_) < 0)
+        return;
+    snprintf(stamp, sizeof(stamp), "|%lld,%lld|", (long long)srcSize_, (long long)srcMtime_);
+    cacheKey_ = std::string(input_ ? input_->getKey() : infile_) + stamp + getOutputKey();
+    cache_ = opts_.cache;
+}
+
+void VAccel::initShard()
+{
+    char sampling[64];
+    std::string key;
+
+    /* records are numbered by the direct path's frame count */
+    if (opts_.pipelined || opts_.onDevice) {
+        fprintf(stderr, "Tensor shard needs a direct host decode, not using it\n");
+        return;
+    }
+    if (statInput(&srcSize_, &srcMtime_) < 0)
+        return;
+
+    /* which frames were kept is part of the content too */
+    snprintf(sampling, sizeof(sampling), "|%d,%d,%g", (int)opts_.sampling,
+             opts_.sampleStride, opts_.dedupThreshold);
+    key = getOutputKey() + sampling;
+    shardKey_ = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++)
+        shardKey_ = (shardKey_ ^ (uint8_t)key[i]) * 1099511628211ULL;
+
+    shardReader_.reset(new VShardReader);
+    if (shardReader_->open(opts_.shard, srcSize_, srcMtime_, shardKey_) < 0) {
+        shardReader_.reset();
+        shardPending_ = true;
     }
+}
 
+int VAccel::statInput(int64_t* size, int64_t* mtime)
+{
+    struct stat st;
+
+    if (input_) {
+        /* custom inputs have no file to stat, only their size ties them */
+        *size = input_->getSize();
+        *mtime = 0;
+        return 0;
+    }
+    if (stat(infile_, &st) < 0) {
+        fprintf(stderr, "Cannot stat input file %s\n", infile_);
+        return -1;
+    }
+    *size = st.st_size;
+    *mtime = st.st_mtime;
     return 0;
 }
 
+void VAccel::initSw()
+{
+    /* frame threads scale with cores, slice threads cut the latency of each frame */
+    decoderCtx_->thread_count = opts_.threads;
+    decoderCtx_->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+void VAccel::initFast()
+{
+    decoderCtx_->skip_loop_filter = AVDISCARD_ALL;
+    decoderCtx_->skip_idct = AVDISCARD_NONREF;
+    decoderCtx_->flags2 |= AV_CODEC_FLAG2_FAST;
+
+    /* hwaccels always decode the full surface */
+    if (sw_ && opts_.lowres > 0 && decoder_->max_lowres > 0)
+        decoderCtx_->lowres = FFMIN(opts_.lowres, decoder_->max_lowres);
+}
+
 int VAccel::getFrame(VFrame* f)
+{
+    int ret = 0;
+    AVFrame *frame = nullptr;
+
+    stopShard();
+    if ((ret = fetch(&frame)) < 0) {
+        if (ret != AVERROR_EOF)
+            stats_.add(VCOUNTER_ERRORS);
+        return ret;
+    }
+
+    ret = output(frame, f);
+    av_frame_free(&frame);
+    stats_.add(ret < 0 ? VCOUNTER_ERRORS : VCOUNTER_FRAMES);
+    return ret;
+}
+
+int VAccel::getFrames(VTensor* t, int n)
+{
+    int ret = 0;
+    int count = 0;
+    AVFrame *frame = nullptr;
+
+    if (n > t->getBatch())
+        n = t->getBatch();
+    if (shardReader_ || shardPending_) {
+        if ((ret = readShard(t, n)) != AVERROR(EAGAIN))
+            return ret;
+    }
+
+    while (count < n) {
+        if ((ret = fetch(&frame)) < 0) {
+            if (ret != AVERROR_EOF)
+                stats_.add(VCOUNTER_ERRORS);
+            break;
+        }
+
+        if (frame->width != t->getWidth() || frame->height != t->getHeight()) {
+            fprintf(stderr, "Frame size %dx%d does not match tensor size %dx%d\n",
+                    frame->width, frame->height, t->getWidth(), t->getHeight());
+            ret = AVERROR(EINVAL);
+        } else {
+            /* the only pass over the pixels, straight into the batch slot */
+            VStatsTimer timer(&stats_, VSTAGE_COPY, t->getSlotSize());
+            ret = convertFrame(frame, t->getSlot(count), t->getLayout(), t->getDataType(),
+                               t->getMean(), t->getStd());
+        }
+        if (ret >= 0 && shardWriter_)
+            writeShard(t, count);
+        av_frame_free(&frame);
+        if (ret < 0) {
+            stats_.add(VCOUNTER_ERRORS);
+            break;
+        }
+        stats_.add(VCOUNTER_FRAMES);
+        count++;
+    }
+    /* decoded to the end from the start, the shard is complete */
+    if (ret == AVERROR_EOF && shardWriter_) {
+        shardWriter_->finish();
+        shardWriter_.reset();
+    }
+
+    t->setCount(count);
+    return (count > 0) ? count : ret;
+}
+
+int VAccel::readShard(VTensor* t, int n)
+{
+    int ret = 0;
+    VShardFormat format;
+
+    if (shardPending_) {
+        /* the first batch fixes the record format */
+        shardPending_ = false;
+        format.height = t->getHeight();
+        format.width = t->getWidth();
+        format.layout = t->getLayout();
+        format.dtype = t->getDataType();
+        for (int i = 0; i < 3; i++) {
+            format.mean[i] = t->getMean()[i];
+            format.std[i] = t->getStd()[i];
+        }
+        format.key = shardKey_;
+        shardWriter_.reset(new VShardWriter);
+        if (shardWriter_->open(opts_.shard, format, srcSize_, srcMtime_) < 0)
+            shardWriter_.reset();
+        return AVERROR(EAGAIN);
+    }
+
+    if (!shardReader_->matches(t)) {
+        fprintf(stderr, "Tensor does not match shard %s, decoding\n", opts_.shard);
+        shardReader_.reset();
+        return AVERROR(EAGAIN);
+    }
+
+    {
+        VStatsTimer timer(&stats_, VSTAGE_COPY);
+        if ((ret = shardReader_->read(t, shardPos_, n)) > 0)
+            timer.setBytes(ret * t->getSlotSize());
+        else
+            timer.cancel();
+    }
+    if (ret > 0) {
+        shardPos_ += ret;
+        stats_.add(VCOUNTER_FRAMES, ret);
+    }
+    return ret;
+}
+
+int VAccel::mapFrames(VTensor* t, int n)
+{
+    int ret = 0;
+
+    if (!shardReader_)
+        return AVERROR(EINVAL);
+
+    if ((ret = shardReader_->map(t, shardPos_, n)) > 0) {
+        shardPos_ += ret;
+        stats_.add(VCOUNTER_FRAMES, ret);
+    }
+    return ret;
+}
+
+int VAccel::writeShard(VTensor* t, int index)
+{
+    if (!shardWriter_->matches(t) || shardWriter_->append(t->getSlot(index), lastNumber_) < 0) {
+        stopShard();
+        return -1;
+    }
+    return 0;
+}
+
+void VAccel::stopShard()
+{
+    /* frames that bypass getFrames() would leave a hole in the shard */
+    shardPending_ = false;
+    if (shardWriter_) {
+        shardWriter_->abort();
+        shardWriter_.reset();
+    }
+}
+
+int VAccel::getRegions(VFrame* f, int n)
+{
+    int ret = 0;
+    int count = (int)opts_.rois.size();
+    AVFrame *frame = nullptr;
+
+    stopShard();
+    if (!count || n < count)
+        return AVERROR(EINVAL);
+
+    if ((ret = nextFrame(&frame)) < 0) {
+        if (ret != AVERROR_EOF)
+            stats_.add(VCOUNTER_ERRORS);
+        return ret;
+    }
+
+    for (int i = 0; i < count && ret >= 0; i++) {
+        VStatsTimer timer(&stats_, VSTAGE_COPY);
+        if ((ret = f[i].copy(frame, &opts_.rois[i])) < 0)
+            fprintf(stderr, "Can not copy region %d\n", i);
+        timer.setBytes(f[i].getSize());
+    }
+    av_frame_free(&frame);
+    stats_.add(ret < 0 ? VCOUNTER_ERRORS : VCOUNTER_FRAMES);
+
+    return (ret < 0) ? ret : count;
+}
+
+int VAccel::getSurface(AVFrame* frame)
+{
+    int ret = 0;
+    AVFrame *next = nullptr;
+
+    stopShard();
+    if ((ret = fetch(&next)) < 0) {
+        if (ret != AVERROR_EOF)
+            stats_.add(VCOUNTER_ERRORS);
+        return ret;
+    }
+
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, next);
+    av_frame_free(&next);
+    stats_.add(VCOUNTER_FRAMES);
+    return 0;
+}
+
+int VAccel::getWidth()
+{
+    if (opts_.outWidth > 0)
+        return opts_.outWidth;
+    if (opts_.crop.width > 0)
+        return opts_.crop.width;
+    return decoderCtx_ ? decoderCtx_->width : 0;
+}
+
+int VAccel::getHeight()
+{
+    if (opts_.outHeight > 0)
+        return opts_.outHeight;
+    if (opts_.crop.height > 0)
+        return opts_.crop.height;
+    return decoderCtx_ ? decoderCtx_->height : 0;
+}
+
+int VAccel::buildIndex(const char* sidecar)
+{
+    std::string path = sidecar ? sidecar : std::string(infile_) + ".vidx";
+    int64_t size = 0, mtime = 0;
+    int ret = 0;
+
+    if (!inputCtx_ || opts_.pipelined)
+        return AVERROR(EINVAL);
+    if (statInput(&size, &mtime) < 0)
+        return -1;
+
+    /* custom inputs have no file to sit next to, only an explicit sidecar */
+    if ((!input_ || sidecar) && index_.load(path.c_str(), size, mtime) == 0)
+        return 0;
+
+    /* scan packets only, then rewind to the first keyframe */
+    if ((ret = index_.build(inputCtx_, stream_)) < 0)
+        return ret;
+    if (!input_ || sidecar)
+        index_.save(path.c_str(), size, mtime);
+
+    return seekToFrame(0);
+}
+
+int VAccel::seekKey(const VIndexKey* key)
+{
+    int ret = -1;
+
+    if (index_.hasPts())
+        ret = av_seek_frame(inputCtx_, stream_, key->pts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0 && key->pos >= 0)
+        ret = av_seek_frame(inputCtx_, stream_, key->pos, AVSEEK_FLAG_BYTE);
+    if (ret < 0)
+        fprintf(stderr, "Cannot seek to keyframe at %lld\n", (long long)key->pts);
+
+    return ret;
+}
+
+int VAccel::seekToFrame(int64_t k)
+{
+    /* the shard has its own index, the decoder still follows if it can */
+    if (shardReader_ && k >= 0)
+        shardPos_ = shardReader_->findFrame(k);
+    else if (!shardPending_ || k != 0)
+        stopShard();
+    if (shardReader_ && !index_.isValid())
+        return 0;
+
+    return reposition(k);
+}
+
+int VAccel::reposition(int64_t k)
+{
+    const VIndexKey *key = nullptr;
+    int ret = 0;
+
+    if (opts_.pipelined || !index_.isValid())
+        return AVERROR(EINVAL);
+    if (k < 0 || k >= index_.getFrameCount())
+        return AVERROR(ERANGE);
+
+    key = index_.findKey(k);
+    if (!key || (ret = seekKey(key)) < 0)
+        return (ret < 0) ? ret : -1;
+
+    avcodec_flush_buffers(decoderCtx_);
+    flush_ = false;
+    decodedIdx_ = 0;
+    frameNo_ = key->frame;
+    seekFrame_ = k;
+    cursor_ = k;
+    skipTo_ = -1;
+    if (dedup_)
+        dedup_->reset();
+    if (filter_)
+        filter_->reset();
+    if (index_.hasPts()) {
+        seekPts_ = index_.getPts(k);
+        seekSkip_ = 0;
+    } else {
+        seekPts_ = AV_NOPTS_VALUE;
+        seekSkip_ = (k > key->frame) ? k - key->frame : 0;
+    }
+
+    return 0;
+}
+
+int VAccel::fetch(AVFrame** frame)
+{
+    int ret = 0;
+    int64_t length = -1;
+    int64_t step = (opts_.sampling == VSAMPLE_STRIDE && opts_.sampleStride > 1) ? opts_.sampleStride : 1;
+    const VIndexKey *key = nullptr;
+
+    if (!cache_)
+        return nextFrame(frame);
+
+    /* served from memory, the decoder stays where it is */
+    if ((length = cache_->getLength(cacheKey_)) >= 0 && cursor_ >= length)
+        return AVERROR_EOF;
+    if (!(*frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (cache_->lookup(cacheKey_, cursor_, *frame)) {
+        lastNumber_ = cursor_;
+        cursor_ += step;
+        stats_.add(VCOUNTER_CACHED);
+        return 0;
+    }
+    av_frame_free(frame);
+
+    /* catch up with the frames handed out from the cache, by seeking when
+       a later keyframe is known, else by decoding and dropping */
+    if (frameNo_ < cursor_) {
+        key = index_.isValid() ? index_.findKey(cursor_) : nullptr;
+        if (!key || key->frame <= frameNo_ || reposition(cursor_) < 0)
+            skipTo_ = cursor_;
+    }
+
+    if ((ret = nextFrame(frame)) == AVERROR_EOF)
+        cache_->setLength(cacheKey_, frameNo_);
+    if (ret < 0)
+        return ret;
+
+    cache_->insert(cacheKey_, lastNumber_, *frame);
+    cursor_ = lastNumber_ + step;
+    return 0;
+}
+
+int VAccel::nextFrame(AVFrame** frame)
 {
     int ret = 0;
     bool received = false;
     AVPacket packet = {};
-    
+
     frameIdx_++;
-    while (!flush_) {
+    if (opts_.pipelined)
+        return popFrame(frame);
+
+    while (1) {
+        /* drain frames already queued in the decoder before feeding more input */
+        ret = receive(frame, &received);
+        if (received || (ret < 0 && ret != AVERROR(EAGAIN)))
+            return ret;
+        if (ret == 0)
+            continue;   /* frame dropped, the decoder may hold more */
+        if (flush_)
+            return AVERROR_EOF;
+
         if (read(&packet) < 0) {
             packet.data = nullptr;
             packet.size = 0;
-            ret = decode(&packet);
-            av_packet_unref(&packet);
             flush_ = true;
-            break;
         }
 
         ret = decode(&packet);
         av_packet_unref(&packet);
         if (ret < 0)
             return ret;
+    }
+}
+
+int VAccel::read(AVPacket* packet)
+{
+    VStatsTimer timer(&stats_, VSTAGE_READ);
+
+    while (1) {
+        if (av_read_frame(inputCtx_, packet) < 0) {
+            timer.cancel();
+            return -1;
+        }
+        if (packet->stream_index == stream_)
+            break;
+        av_packet_unref(packet);
+    }
+
+    timer.setBytes(packet->size);
+    return 0;
+}
+
+int VAccel::decode(AVPacket* packet)
+{
+    int ret = 0;
+    VStatsTimer timer(&stats_, VSTAGE_DECODE, packet ? packet->size : 0);
+
+    ret = avcodec_send_packet(decoderCtx_, packet);
+    if (ret < 0) {
+        fprintf(stderr, "Error during decoding\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+int VAccel::receive(AVFrame** out, bool* done)
+{
+    int ret = 0;
+    int64_t number = 0;
+    AVFrame *frame = nullptr;
+
+    if (!(frame = av_frame_alloc())) {
+        fprintf(stderr, "Can not alloc frame\n");
+        return AVERROR(ENOMEM);
+    }
 
-        ret = receive(f, false, &received);
-        if (ret < 0 || received)
+    {
+        VStatsTimer timer(&stats_, VSTAGE_RECEIVE);
+        if ((ret = avcodec_receive_frame(decoderCtx_, frame)) < 0)
+            timer.cancel();
+    }
+    if (ret == AVERROR_EOF && filter_) {
+        /* decoder is drained, flush what the filter graph still holds */
+        av_frame_free(&frame);
+        if ((ret = filterFrame(&frame)) < 0)
             return ret;
+        *done = true;
+        return transfer(frame, out);
+    }
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        av_frame_free(&frame);
+        return ret;
+    } else if (ret < 0) {
+        fprintf(stderr, "Error while decoding\n");
+        av_frame_free(&frame);
+        return ret;
+    }
+
+    number = frameNo_++;
+    if (!keep(frame, &number)) {
+        /* dropped before the host transfer, the caller just keeps receiving */
+        av_frame_free(&frame);
+        stats_.add(VCOUNTER_DROPPED);
+        return 0;
+    }
+    if (duplicate(frame)) {
+        av_frame_free(&frame);
+        return 0;
     }
 
-    while (flush_) {
-        ret = receive(f, true, &received);
-        if (ret < 0 || received)
+    if (filter_) {
+        ret = filterFrame(&frame);
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        if (ret < 0)
             return ret;
     }
+
+    lastNumber_ = number;
+    *done = true;
+    return transfer(frame, out);
 }
 
-int VAccel::read(AVPacket* packet)
+int VAccel::filterFrame(AVFrame** frame)
 {
-    if (av_read_frame(inputCtx_, packet) < 0)
-        return -1;
+    int ret = 0;
+    AVFrame *out = nullptr;
+    VStatsTimer timer(&stats_, VSTAGE_FILTER);
+
+    /* a null frame flushes the graph */
+    ret = filter_->push(*frame);
+    av_frame_free(frame);
+    if (ret < 0)
+        return ret;
+
+    if (!(out = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = filter_->pull(out)) < 0) {
+        av_frame_free(&out);
+        return ret;
+    }
 
+    *frame = out;
     return 0;
 }
 
-int VAccel::decode(AVPacket* packet)
+bool VAccel::keep(AVFrame* frame, int64_t* number)
+{
+    /* frames between the keyframe and the seek target are decoded, never returned */
+    if (seekPts_ != AV_NOPTS_VALUE) {
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE &&
+            frame->best_effort_timestamp < seekPts_)
+            return false;
+        seekPts_ = AV_NOPTS_VALUE;
+    } else if (seekSkip_ > 0) {
+        seekSkip_--;
+        return false;
+    }
+
+    /* the first frame kept after a seek is its target, the next ones follow it */
+    if (seekFrame_ >= 0) {
+        *number = seekFrame_;
+        frameNo_ = seekFrame_ + 1;
+        seekFrame_ = -1;
+    }
+    /* frames already handed out from the cache, the decoder only catches up */
+    if (skipTo_ >= 0) {
+        if (*number < skipTo_)
+            return false;
+        skipTo_ = -1;
+        decodedIdx_ = 0;
+    }
+
+    return sample();
+}
+
+bool VAccel::duplicate(AVFrame* frame)
+{
+    if (!dedup_)
+        return false;
+
+    /* a still scene costs a signature per frame, never a filter pass or download */
+    VStatsTimer timer(&stats_, VSTAGE_DEDUP);
+    if (!dedup_->isDuplicate(frame))
+        return false;
+    stats_.add(VCOUNTER_DUPLICATES);
+    return true;
+}
+
+bool VAccel::sample()
+{
+    int64_t idx = decodedIdx_++;
+
+    if (opts_.sampling != VSAMPLE_STRIDE || opts_.sampleStride <= 1)
+        return true;
+    return (idx % opts_.sampleStride) == 0;
+}
+
+int VAccel::transfer(AVFrame* frame, AVFrame** out)
 {
     int ret = 0;
+    AVFrame *sw_frame = nullptr;
 
-    if (stream_ != packet->stream_index)
-        return -1;
+    /* host frames, and surfaces that stay on the device for getSurface() */
+    if (frame->format != hwPixFmt_ || opts_.onDevice) {
+        *out = frame;
+        return 0;
+    }
 
-    ret = avcodec_send_packet(decoderCtx_, packet);
+    if (!(sw_frame = av_frame_alloc())) {
+        fprintf(stderr, "Can not alloc frame\n");
+        av_frame_free(&frame);
+        return AVERROR(ENOMEM);
+    }
+
+    /* retrieve data from GPU to CPU */
+    {
+        VStatsTimer timer(&stats_, VSTAGE_TRANSFER);
+        ret = -1;
+        if (map_) {
+            /* regions read only their windows, map the surface instead of downloading it */
+            ret = av_hwframe_map(sw_frame, frame, AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT);
+            if (ret < 0) {
+                fprintf(stderr, "Can not map surfaces, downloading whole frames\n");
+                av_frame_unref(sw_frame);
+                map_ = false;
+            }
+        }
+        if (ret < 0) {
+            if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
+                timer.cancel();
+            else
+                timer.setBytes(av_image_get_buffer_size((AVPixelFormat)sw_frame->format,
+                                                        sw_frame->width, sw_frame->height, 1));
+        }
+    }
     if (ret < 0) {
-        fprintf(stderr, "Error during decoding\n");
+        fprintf(stderr, "Error transferring the data to system memory\n");
+        av_frame_free(&sw_frame);
+    } else {
+        av_frame_copy_props(sw_frame, frame);
+        *out = sw_frame;
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+int VAccel::output(AVFrame* frame, VFrame* f)
+{
+    int ret = 0;
+    VStatsTimer timer(&stats_, VSTAGE_COPY);
+
+    if (opts_.zeroCopy) {
+        /* VFrame keeps the refcounted planes, released on its next reuse */
+        if ((ret = f->attach(frame)) < 0)
+            fprintf(stderr, "Can not reference frame\n");
+        return ret;
+    }
+
+    /* same format and plane layout as decoded (NV12, P010, ...), rows realigned */
+    if ((ret = f->copy(frame)) < 0) {
+        fprintf(stderr, "Can not copy frame\n");
         return ret;
     }
+    timer.setBytes(f->getSize());
+
+    return 0;
+}
+
+int VAccel::startPipeline()
+{
+    packets_.reset(new VQueue<AVPacket*>(opts_.queueDepth));
+    decoded_.reset(new VQueue<AVFrame*>(opts_.queueDepth));
+    ready_.reset(new VQueue<AVFrame*>(opts_.queueDepth));
+    stats_.setCapacity(VQUEUE_PACKETS, packets_->capacity());
+    stats_.setCapacity(VQUEUE_DECODED, decoded_->capacity());
+    stats_.setCapacity(VQUEUE_READY, ready_->capacity());
+
+    demuxThread_ = std::thread(&VAccel::demuxLoop, this);
+    decodeThread_ = std::thread(&VAccel::decodeLoop, this);
+    downloadThread_ = std::thread(&VAccel::downloadLoop, this);
 
     return 0;
 }
 
-int VAccel::receive(VFrame* f, bool bFlush, bool* done)
+void VAccel::stopPipeline()
+{
+    AVPacket *packet = nullptr;
+    AVFrame *frame = nullptr;
+
+    stop_ = true;
+    if (demuxThread_.joinable())
+        demuxThread_.join();
+    if (decodeThread_.joinable())
+        decodeThread_.join();
+    if (downloadThread_.joinable())
+        downloadThread_.join();
+
+    while (packets_ && packets_->tryPop(packet))
+        av_packet_free(&packet);
+    while (decoded_ && decoded_->tryPop(frame))
+        av_frame_free(&frame);
+    while (ready_ && ready_->tryPop(frame))
+        av_frame_free(&frame);
+}
+
+/* pipeline stages, a null item marks the end of the stream for the next stage */
+
+void VAccel::demuxLoop()
+{
+    AVPacket *packet = nullptr;
+
+    while (!stop_) {
+        if (!(packet = av_packet_alloc())) {
+            error_ = AVERROR(ENOMEM);
+            break;
+        }
+        if (read(packet) < 0) {
+            av_packet_free(&packet);
+            break;
+        }
+        if (!packets_->push(packet, stop_)) {
+            av_packet_free(&packet);
+            return;
+        }
+        stats_.setDepth(VQUEUE_PACKETS, packets_->size());
+    }
+
+    packets_->push(nullptr, stop_);
+}
+
+void VAccel::decodeLoop()
 {
     int ret = 0;
-    int size = 0;
-    AVFrame *frame = nullptr, *sw_frame = nullptr;
-    AVFrame *tmp_frame = nullptr;
-    uint8_t *buffer = nullptr;
+    AVPacket *packet = nullptr;
+    AVFrame *frame = nullptr;
 
-    while (1) {
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
-            fprintf(stderr, "Can not alloc frame\n");
-            ret = AVERROR(ENOMEM);
-            goto fail;
+    while (!stop_) {
+        if (!(frame = av_frame_alloc())) {
+            error_ = AVERROR(ENOMEM);
+            break;
         }
 
-        ret = avcodec_receive_frame(decoderCtx_, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+        {
+            VStatsTimer timer(&stats_, VSTAGE_RECEIVE);
+            if ((ret = avcodec_receive_frame(decoderCtx_, frame)) < 0)
+                timer.cancel();
+        }
+        if (ret == 0 && !sample()) {
+            av_frame_free(&frame);
+            stats_.add(VCOUNTER_DROPPED);
+            continue;
+        }
+        if (ret == 0 && duplicate(frame)) {
             av_frame_free(&frame);
-            av_frame_free(&sw_frame);
-            return (ret == AVERROR_EOF) ? ret : 0;
-        } else if (ret < 0) {
+            continue;
+        }
+        if (ret == 0) {
+            if (!decoded_->push(frame, stop_)) {
+                av_frame_free(&frame);
+                return;
+            }
+            stats_.setDepth(VQUEUE_DECODED, decoded_->size());
+            continue;
+        }
+        av_frame_free(&frame);
+        if (ret == AVERROR_EOF)
+            break;
+        if (ret != AVERROR(EAGAIN)) {
             fprintf(stderr, "Error while decoding\n");
-            goto fail;
+            error_ = ret;
+            break;
         }
 
-        *done = true;
-        if (frame->format == hwPixFmt) {
-            /* retrieve data from GPU to CPU */
-            if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
-                fprintf(stderr, "Error transferring the data to system memory\n");
-                goto fail;
-            }
-            tmp_frame = sw_frame;
-        } else
-            tmp_frame = frame;
-
-        size = av_image_get_buffer_size((AVPixelFormat)tmp_frame->format, tmp_frame->width,
-                                        tmp_frame->height, 1);
-        
-        if (!f->getBuf()) {
-            f->allocate(tmp_frame->width, tmp_frame->height);
-        }
-        buffer = f->getBuf();
-
-        ret = av_image_copy_to_buffer(buffer, size,
-                                      (const uint8_t * const *)tmp_frame->data,
-                                      (const int *)tmp_frame->linesize, (AVPixelFormat)tmp_frame->format,
-                                      tmp_frame->width, tmp_frame->height, 1);
+        /* decoder wants input, a null packet enters draining mode */
+        if (!packets_->pop(packet, stop_))
+            return;
+        stats_.setDepth(VQUEUE_PACKETS, packets_->size());
+        ret = decode(packet);
+        av_packet_free(&packet);
         if (ret < 0) {
-            fprintf(stderr, "Can not copy image to buffer\n");
-            goto fail;
+            error_ = ret;
+            break;
         }
+    }
 
-    fail:
-        av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        if (ret < 0)
-            return ret;
-        if (bFlush)
+    decoded_->push(nullptr, stop_);
+}
+
+void VAccel::downloadLoop()
+{
+    int ret = 0;
+    bool draining = false;
+    AVFrame *frame = nullptr, *out = nullptr;
+
+    while (!stop_) {
+        if (!draining) {
+            if (!decoded_->pop(frame, stop_))
+                return;
+            stats_.setDepth(VQUEUE_DECODED, decoded_->size());
+            if (!frame && !filter_)
+                break;
+            draining = !frame;
+        }
+
+        if (filter_) {
+            ret = filterFrame(&frame);
+            if (ret == AVERROR(EAGAIN))
+                continue;
+            if (ret == AVERROR_EOF)
+                break;
+            if (ret < 0) {
+                error_ = ret;
+                break;
+            }
+        }
+
+        ret = transfer(frame, &out);
+        frame = nullptr;
+        if (ret < 0) {
+            error_ = ret;
             break;
+        }
+        if (!ready_->push(out, stop_)) {
+            av_frame_free(&out);
+            return;
+        }
+        stats_.setDepth(VQUEUE_READY, ready_->size());
     }
 
+    ready_->push(nullptr, stop_);
+}
+
+int VAccel::popFrame(AVFrame** frame)
+{
+    if (!flush_ && (!ready_->pop(*frame, stop_) || !*frame))
+        flush_ = true;
+    stats_.setDepth(VQUEUE_READY, ready_->size());
+    if (flush_)
+        return error_ ? error_.load() : AVERROR_EOF;
+
     return 0;
-}
\ No newline at end of file
+}
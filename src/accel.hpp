@@ -10,32 +10,233 @@ extern "C" {
 #include <libavutil/imgutils.h>
 }
 
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "catalog.hpp"
+#include "dedup.hpp"
+#include "filter.hpp"
 #include "frame.hpp"
+#include "index.hpp"
+#include "input.hpp"
+#include "queue.hpp"
+#include "shard.hpp"
+#include "stats.hpp"
+#include "tensor.hpp"
+
+enum VSampleMode
+{
+    VSAMPLE_ALL = 0,
+    // only keyframes are decoded, the decoder discards everything else
+    VSAMPLE_KEYFRAMES,
+    // every frame is decoded (references are needed) but only one out of
+    // sampleStride is downloaded and returned
+    VSAMPLE_STRIDE,
+};
+
+struct VAccelOptions
+{
+    // hand out references to the decoder's frame buffers instead of copying
+    // them into VFrame::getBuf(), see VFrame::attach()
+    bool zeroCopy = false;
+    // run demux, decode and download on their own threads joined by bounded
+    // queues, getFrame() then only pops a finished frame
+    bool pipelined = false;
+    // capacity of each inter-stage queue in pipelined mode
+    int queueDepth = 4;
+    // existing device context to decode on instead of creating one, a new
+    // reference is taken (see VAccelManager)
+    AVBufferRef *hwDevice = nullptr;
+    VSampleMode sampling = VSAMPLE_ALL;
+    int sampleStride = 1;
+    // decode on the CPU when the HW device or codec config is unavailable,
+    // type "sw" selects the software decoder directly
+    bool swFallback = true;
+    // software decoder threads, 0 picks one per core
+    int threads = 0;
+    // preview profile: skip the loop filter everywhere and the IDCT on
+    // non-reference frames, allow non-spec-compliant speedups, and on the
+    // software path decode at 1/2^lowres size when the codec can; output
+    // is not bit-exact
+    bool fast = false;
+    int lowres = 1;
+    // crop/scale/convert before the host transfer (VFilter), 0/empty keeps
+    // the decoded size, window and pixel format
+    int outWidth = 0;
+    int outHeight = 0;
+    VRect crop = {};
+    const char* outFormat = nullptr;
+    // windows of the output frame read by getRegions(); when set, HW surfaces
+    // are mapped rather than downloaded so only these rows cross the bus
+    std::vector<VRect> rois;
+    // cap container probing, 0 keeps FFmpeg's defaults (5 MB, 5 s in us)
+    int64_t probeSize = 0;
+    int64_t analyzeDuration = 0;
+    // shared stream info cache, not owned; a hit for a file path skips
+    // probing and avformat_find_stream_info(), a miss adds the file
+    VCatalog* catalog = nullptr;
+    // keep decoded frames on the device: getSurface() returns the VAAPI
+    // surfaces (scaled by the filter when outWidth/outHeight are set) and
+    // nothing is downloaded, getFrame() then only works on the software path
+    bool onDevice = false;
+    // surfaces the caller holds on to at once on top of what the decoder and
+    // filter need, e.g. frames queued in a VEncoder
+    int extraSurfaces = 0;
+    // drop frames whose luma signature differs from the last returned frame
+    // by less than this mean absolute difference (0-255, see VDedup); checked
+    // before the filter and the download, 0 disables
+    float dedupThreshold = 0;
+    // shared decoded frame cache, not owned; getFrame(), getFrames() and
+    // getSurface() return cached frames without decoding and cache the ones
+    // they decode. Frames are keyed by the input file (VInput::getKey() for
+    // custom inputs) with its size and mtime, the crop/scale/format options
+    // and the frame number;
+    // needs every frame or stride sampling, no dedup, no pipeline and no
+    // onDevice (it is ignored otherwise)
+    VFrameCache* cache = nullptr;
+    // decoded tensor shard of this input (see VShardReader); when it exists
+    // and was written with the same output options and tensor format,
+    // getFrames() copies its records (mapFrames() wraps them without a copy)
+    // instead of decoding, otherwise a decode
+    // through getFrames() from the first frame to the end writes it. Other
+    // getters and seeking before the end stop the writing; not pipelined
+    const char* shard = nullptr;
+};
 
 class VAccel
 {
 public:
     VAccel(const char* inf, const char* outf="out.yuv", const char* type="vaapi");
+    // decode from a memory buffer, mapped file region or callbacks, takes
+    // ownership of input
+    VAccel(VInput* input, const char* type="vaapi");
     ~VAccel();
 
-    int init();
+    int init(const VAccelOptions& opts = VAccelOptions());
     int getFrame(VFrame* f);
+    // decode up to n frames into consecutive slots of t, returns the number written
+    int getFrames(VTensor* t, int n);
+    // decode the next frame and copy opts.rois[i] into f[i], n must cover
+    // every ROI; returns the number of regions written
+    int getRegions(VFrame* f, int n);
+    // the next frame as decoded and filtered, without the host transfer when
+    // opts.onDevice is set; the caller owns the references in frame
+    int getSurface(AVFrame* frame);
+    int getWidth();
+    int getHeight();
+    bool isHardware() { return !sw_; }
+
+    // load the keyframe index from the sidecar file (default "<input>.vidx"),
+    // or build and save it; needed by seekToFrame()
+    int buildIndex(const char* sidecar=nullptr);
+    int64_t getFrameCount() { return index_.getFrameCount(); }
+    // the next getFrame()/getFrames() returns frame k (presentation order),
+    // decoding only from the keyframe before it; not available when pipelined
+    int seekToFrame(int64_t k);
+    // whether getFrames() reads from opts.shard
+    bool isShardRead() { return shardReader_ != nullptr; }
+    // like getFrames() on a shard being read, but t is wrapped around up to n
+    // records of the mapping instead of copying them; t stays valid while this
+    // VAccel lives. AVERROR(EINVAL) when the shard is not read or its records
+    // are padded, getFrames() works in both cases
+    int mapFrames(VTensor* t, int n);
+
+    // per-stage latency, bytes and queue depths, safe to read while decoding
+    VStats* getStats() { return &stats_; }
 private:
+    int openInput();
+    int initHw();
+    void initSw();
+    void initCache();
+    void initShard();
+    int statInput(int64_t* size, int64_t* mtime);
+    std::string getOutputKey();
+    int readShard(VTensor* t, int n);
+    int writeShard(VTensor* t, int index);
+    void stopShard();
+    void initFast();
+    static enum AVPixelFormat getHwFormat(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts);
+    int fetch(AVFrame** frame);
+    int nextFrame(AVFrame** frame);
+    bool sample();
+    bool keep(AVFrame* frame, int64_t* number);
+    bool duplicate(AVFrame* frame);
+    int seekKey(const VIndexKey* key);
+    // decoder side of seekToFrame(), also used to catch up with the frame
+    // cache; the returned frames stay in order, so a shard being written goes on
+    int reposition(int64_t k);
     int read(AVPacket* packet);
     int decode(AVPacket* packet);
-    int receive(VFrame* f, bool bFlush, bool* done);
+    int receive(AVFrame** out, bool* done);
+    int filterFrame(AVFrame** frame);
+    int transfer(AVFrame* frame, AVFrame** out);
+    int output(AVFrame* frame, VFrame* f);
+
+    int startPipeline();
+    void stopPipeline();
+    void demuxLoop();
+    void decodeLoop();
+    void downloadLoop();
+    int popFrame(AVFrame** frame);
 
 private:
-    const char* vatype_;
     const char* infile_;
     const char* outfile_;
+    const char* vatype_;
+    std::unique_ptr<VInput> input_;
+    std::unique_ptr<VFilter> filter_;
+    std::unique_ptr<VDedup> dedup_;
+    VAccelOptions opts_;
     AVBufferRef *hwDeviceCtx_ = nullptr;
     AVFormatContext *inputCtx_ = nullptr;
     AVCodecContext *decoderCtx_ = nullptr;
     AVStream *video_ = nullptr;
     AVCodec *decoder_ = nullptr;
+    enum AVPixelFormat hwPixFmt_ = AV_PIX_FMT_NONE;
+    bool sw_ = false;
+    bool map_ = false;
     int frameIdx_ = 0;
+    int64_t decodedIdx_ = 0;
     int stream_ = -1;
     bool flush_ = false;
+
+    VIndex index_;
+    int64_t seekPts_ = AV_NOPTS_VALUE;
+    int64_t seekSkip_ = 0;
+    int64_t seekFrame_ = -1;
+
+    // frame numbers (presentation order) for the frame cache: of the next
+    // frame out of the decoder, of the last one returned by it, of the next
+    // one to return, and of the first one to keep while catching up
+    VFrameCache *cache_ = nullptr;
+    std::string cacheKey_;
+    int64_t frameNo_ = 0;
+    int64_t lastNumber_ = -1;
+    int64_t cursor_ = 0;
+    int64_t skipTo_ = -1;
+
+    // shard read instead of decoding, or written while decoding from the
+    // first frame (shardPending_ until the first getFrames())
+    std::unique_ptr<VShardReader> shardReader_;
+    std::unique_ptr<VShardWriter> shardWriter_;
+    bool shardPending_ = false;
+    int64_t shardPos_ = 0;
+    uint64_t shardKey_ = 0;
+    int64_t srcSize_ = 0;
+    int64_t srcMtime_ = 0;
+
+    VStats stats_;
+
+    std::unique_ptr<VQueue<AVPacket*>> packets_;
+    std::unique_ptr<VQueue<AVFrame*>> decoded_;
+    std::unique_ptr<VQueue<AVFrame*>> ready_;
+    std::thread demuxThread_;
+    std::thread decodeThread_;
+    std::thread downloadThread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<int> error_{0};
 };
 
@@ -0,0 +1,351 @@
+// Decode benchmark. Encodes a fixed set of synthetic streams (several sizes and
+// GOP structures) with the encoders built into libavcodec, then decodes each one
+// with every requested backend and access mode and prints fps, per-frame latency
+// percentiles and bytes moved per frame, plus the luma PSNR against an exact decode
+// for the fast preview profile. Streams are cached in the -d directory, so
+// repeated runs decode identical input.
+//
+//   bench [-f frames] [-d dir] [-b sw,vaapi] [-r runs]
+
+#include "accel.hpp"
+#include "frame.hpp"
+#include "stats.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct BenchStream
+{
+    const char* name;
+    int width;
+    int height;
+    int gop;
+    int bframes;
+};
+
+struct BenchMode
+{
+    const char* name;
+    bool zeroCopy;
+    bool pipelined;
+    bool fast;
+};
+
+static const BenchStream streams[] = {
+    { "360p-intra",  640,  360,  1, 0 },
+    { "360p-ipp",    640,  360, 30, 0 },
+    { "720p-intra", 1280,  720,  1, 0 },
+    { "720p-ipp",   1280,  720, 30, 0 },
+    { "720p-ibbp",  1280,  720, 30, 2 },
+    { "1080p-ipp",  1920, 1080, 30, 0 },
+    { "1080p-ibbp", 1920, 1080, 30, 2 },
+};
+
+static const BenchMode modes[] = {
+    { "copy",      false, false, false },
+    { "zerocopy",  true,  false, false },
+    { "pipelined", false, true,  false },
+    { "fast",      false, false, true  },
+};
+
+/* moving gradient plus a bouncing block, cheap to draw and not trivially compressible */
+static void drawFrame(AVFrame* frame, int i)
+{
+    int w = frame->width, h = frame->height;
+    int bx = (i * 7) % (w - 64), by = (i * 5) % (h - 64);
+
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < w; x++)
+            row[x] = (uint8_t)(x + y + i * 3 + ((x * 7) ^ (y * 13)) % 17);
+        if (y >= by && y < by + 64)
+            memset(row + bx, 235, 64);
+    }
+    for (int y = 0; y < h / 2; y++) {
+        uint8_t *u = frame->data[1] + y * frame->linesize[1];
+        uint8_t *v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < w / 2; x++) {
+            u[x] = (uint8_t)(128 + x / 4 - i);
+            v[x] = (uint8_t)(128 + y / 4 + i);
+        }
+    }
+}
+
+static int writePackets(AVCodecContext* enc, AVFormatContext* oc, AVStream* st)
+{
+    int ret = 0;
+    AVPacket pkt = {};
+
+    while ((ret = avcodec_receive_packet(enc, &pkt)) == 0) {
+        av_packet_rescale_ts(&pkt, enc->time_base, st->time_base);
+        pkt.stream_index = st->index;
+        if ((ret = av_interleaved_write_frame(oc, &pkt)) < 0)
+            return ret;
+    }
+
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static int encodeStream(const char* path, const BenchStream& s, int frames)
+{
+    int ret = 0;
+    AVCodec *codec = nullptr;
+    AVFormatContext *oc = nullptr;
+    AVCodecContext *enc = nullptr;
+    AVStream *st = nullptr;
+    AVFrame *frame = nullptr;
+
+    /* H.264 when libx264 is built in, MPEG-4 part 2 always is */
+    if (!(codec = avcodec_find_encoder_by_name("libx264")))
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if (!codec) {
+        fprintf(stderr, "No encoder for the benchmark streams\n");
+        return -1;
+    }
+
+    if (avformat_alloc_output_context2(&oc, nullptr, nullptr, path) < 0 ||
+        !(enc = avcodec_alloc_context3(codec)) || !(frame = av_frame_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    enc->width = s.width;
+    enc->height = s.height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->time_base = av_make_q(1, 30);
+    enc->framerate = av_make_q(30, 1);
+    enc->gop_size = s.gop;
+    enc->max_b_frames = s.bframes;
+    if (codec->id == AV_CODEC_ID_MPEG4) {
+        enc->flags |= AV_CODEC_FLAG_QSCALE;
+        enc->global_quality = FF_QP2LAMBDA * 4;
+    } else {
+        av_opt_set(enc->priv_data, "preset", "fast", 0);
+        av_opt_set(enc->priv_data, "crf", "20", 0);
+    }
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((ret = avcodec_open2(enc, codec, nullptr)) < 0 ||
+        !(st = avformat_new_stream(oc, nullptr)) ||
+        (ret = avcodec_parameters_from_context(st->codecpar, enc)) < 0) {
+        fprintf(stderr, "Can not open the %s encoder\n", codec->name);
+        ret = (ret < 0) ? ret : -1;
+        goto end;
+    }
+    st->time_base = enc->time_base;
+
+    if ((ret = avio_open(&oc->pb, path, AVIO_FLAG_WRITE)) < 0 ||
+        (ret = avformat_write_header(oc, nullptr)) < 0) {
+        fprintf(stderr, "Can not write %s\n", path);
+        goto end;
+    }
+
+    frame->format = enc->pix_fmt;
+    frame->width = enc->width;
+    frame->height = enc->height;
+    if ((ret = av_frame_get_buffer(frame, 32)) < 0)
+        goto end;
+
+    for (int i = 0; i < frames; i++) {
+        if ((ret = av_frame_make_writable(frame)) < 0)
+            goto end;
+        drawFrame(frame, i);
+        frame->pts = i;
+        if ((ret = avcodec_send_frame(enc, frame)) < 0 || (ret = writePackets(enc, oc, st)) < 0)
+            goto end;
+    }
+    if ((ret = avcodec_send_frame(enc, nullptr)) < 0 || (ret = writePackets(enc, oc, st)) < 0)
+        goto end;
+    ret = av_write_trailer(oc);
+
+end:
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    if (oc && oc->pb)
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    if (ret < 0)
+        remove(path);
+    return ret;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+/* luma PSNR of a decode with opts against an exact decode of the same stream, the
+   reference is box filtered down when the test decode ran at a lower resolution */
+static double measurePsnr(const char* path, const char* type, const VAccelOptions& opts)
+{
+    VAccelOptions exact;
+    VFrame rf, tf;
+    double sse = 0.0;
+    int64_t count = 0;
+
+    exact.swFallback = false;
+    VAccel ref(path, "out.yuv", type);
+    VAccel test(path, "out.yuv", type);
+    if (ref.init(exact) != 0 || test.init(opts) != 0)
+        return -1.0;
+
+    while (ref.getFrame(&rf) == 0 && test.getFrame(&tf) == 0) {
+        int f = rf.getWidth() / tf.getWidth();
+        if (f < 1 || tf.getHeight() * f > rf.getHeight())
+            return -1.0;
+
+        for (int y = 0; y < tf.getHeight(); y++) {
+            const uint8_t *t = tf.getData(0) + y * tf.getLinesize(0);
+            for (int x = 0; x < tf.getWidth(); x++) {
+                int sum = 0;
+                for (int j = 0; j < f; j++) {
+                    const uint8_t *r = rf.getData(0) + (y * f + j) * rf.getLinesize(0) + x * f;
+                    for (int i = 0; i < f; i++)
+                        sum += r[i];
+                }
+                double d = (double)(sum + f * f / 2) / (f * f) - t[x];
+                sse += d * d;
+            }
+        }
+        count += (int64_t)tf.getWidth() * tf.getHeight();
+    }
+
+    if (!count)
+        return -1.0;
+    return (sse > 0.0) ? 10.0 * log10(255.0 * 255.0 * count / sse) : INFINITY;
+}
+
+static int runCase(const char* path, const char* type, const BenchStream& s, const BenchMode& m)
+{
+    VAccelOptions opts;
+    VFrame vf;
+    VStageStats copy, transfer;
+    std::vector<double> lat;
+    int64_t start = 0, t0 = 0, total = 0;
+    int ret = 0;
+
+    opts.zeroCopy = m.zeroCopy;
+    opts.pipelined = m.pipelined;
+    opts.fast = m.fast;
+    /* measure the backend that was asked for, never a silent fallback */
+    opts.swFallback = false;
+
+    VAccel accel(path, "out.yuv", type);
+    if (accel.init(opts) != 0) {
+        printf("%-8s %-11s %-10s skipped, backend not available\n", type, s.name, m.name);
+        return 0;
+    }
+
+    start = VStats::now();
+    while (1) {
+        t0 = VStats::now();
+        if ((ret = accel.getFrame(&vf)) < 0)
+            break;
+        lat.push_back((VStats::now() - t0) * 1e-6);
+    }
+    total = VStats::now() - start;
+    if (ret != AVERROR_EOF) {
+        fprintf(stderr, "%s %s %s: decode failed (%d)\n", type, s.name, m.name, ret);
+        return ret;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    accel.getStats()->getStage(VSTAGE_COPY, &copy);
+    accel.getStats()->getStage(VSTAGE_TRANSFER, &transfer);
+    size_t n = lat.size() ? lat.size() : 1;
+
+    /* outside the timed loop, it decodes the stream twice more */
+    char psnr[16] = "-";
+    if (m.fast) {
+        double db = measurePsnr(path, type, opts);
+        if (db >= 0.0)
+            snprintf(psnr, sizeof(psnr), "%.2f", db);
+    }
+
+    printf("%-8s %-11s %-10s %6zu %9.1f %8.3f %8.3f %8.3f %8.3f %10.2f %10.2f %8s\n",
+           type, s.name, m.name, lat.size(), lat.size() / (total * 1e-9),
+           percentile(lat, 0.50), percentile(lat, 0.90), percentile(lat, 0.99),
+           lat.empty() ? 0.0 : lat.back(),
+           transfer.bytes / (double)n / (1 << 20), copy.bytes / (double)n / (1 << 20), psnr);
+    return 0;
+}
+
+static void usage(const char* prog)
+{
+    printf("usage: %s [-f frames] [-d dir] [-b backend[,backend...]] [-r runs]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    int frames = 300;
+    int runs = 1;
+    std::string dir = ".";
+    std::string backends = "sw,vaapi";
+    std::vector<std::string> types;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            backends = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (frames <= 0 || runs <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    for (size_t pos = 0; pos <= backends.size(); ) {
+        size_t end = backends.find(',', pos);
+        if (end == std::string::npos)
+            end = backends.size();
+        if (end > pos)
+            types.push_back(backends.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    printf("%-8s %-11s %-10s %6s %9s %8s %8s %8s %8s %10s %10s %8s\n",
+           "backend", "stream", "mode", "frames", "fps", "p50 ms", "p90 ms", "p99 ms",
+           "max ms", "dl MB/f", "copy MB/f", "psnr dB");
+
+    for (const BenchStream& s : streams) {
+        struct stat st;
+        std::string path = dir + "/bench-" + s.name + "-" + std::to_string(frames) + ".mp4";
+
+        if (stat(path.c_str(), &st) < 0 && encodeStream(path.c_str(), s, frames) < 0) {
+            fprintf(stderr, "Can not create benchmark stream %s\n", path.c_str());
+            return -1;
+        }
+
+        for (const std::string& type : types) {
+            for (const BenchMode& m : modes) {
+                for (int r = 0; r < runs; r++) {
+                    if (runCase(path.c_str(), type.c_str(), s, m) < 0)
+                        ret = -1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
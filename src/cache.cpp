@@ -0,0 +1,183 @@
+#include "cache.hpp"
+#include <stdio.h>
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+}
+
+VFrameCache::VFrameCache(size_t budget, int shards) :
+    budget_(budget),
+    shardBudget_(budget / (shards > 0 ? shards : 1)),
+    shards_(shards > 0 ? shards : 1)
+{
+}
+
+VFrameCache::~VFrameCache()
+{
+    clear();
+}
+
+bool VFrameCache::lookup(const std::string& source, int64_t index, AVFrame* frame)
+{
+    Key key = { source, index };
+    Shard& s = getShard(key);
+
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.map.find(key);
+        if (it != s.map.end()) {
+            Entry& e = s.ring[it->second];
+            av_frame_unref(frame);
+            if (av_frame_ref(frame, e.frame) == 0) {
+                e.referenced = true;
+                hits_++;
+                return true;
+            }
+        }
+    }
+
+    misses_++;
+    return false;
+}
+
+bool VFrameCache::lookup(const std::string& source, int64_t index, VFrame* f)
+{
+    AVFrame *frame = av_frame_alloc();
+    bool hit = false;
+
+    if (!frame)
+        return false;
+    hit = lookup(source, index, frame) && f->attach(frame) == 0;
+    av_frame_free(&frame);
+
+    return hit;
+}
+
+int VFrameCache::insert(const std::string& source, int64_t index, const AVFrame* frame)
+{
+    Key key = { source, index };
+    Shard& s = getShard(key);
+    AVFrame *ref = nullptr;
+    size_t bytes = 0, slot = 0;
+
+    if (frame->hw_frames_ctx)
+        return AVERROR(EINVAL);
+    /* what the buffers really pin, padding and pool slack included */
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        bytes += frame->buf[i]->size;
+    if (!bytes || bytes > shardBudget_)
+        return AVERROR(ENOSPC);
+    if (!(ref = av_frame_clone(frame)))
+        return AVERROR(ENOMEM);
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.map.find(key);
+    if (it != s.map.end())
+        release(s, it->second);
+    evict(s, bytes);
+
+    if (!s.freeSlots.empty()) {
+        slot = s.freeSlots.back();
+        s.freeSlots.pop_back();
+    } else {
+        slot = s.ring.size();
+        s.ring.push_back(Entry());
+    }
+    Entry& e = s.ring[slot];
+    e.key = key;
+    e.frame = ref;
+    e.bytes = bytes;
+    /* a new entry survives one sweep, like a just used one */
+    e.referenced = true;
+    s.map[key] = slot;
+    s.bytes += bytes;
+
+    return 0;
+}
+
+int VFrameCache::insert(const std::string& source, int64_t index, VFrame* f)
+{
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+    if ((ret = f->refFrame(frame)) == 0)
+        ret = insert(source, index, frame);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+void VFrameCache::release(Shard& s, size_t slot)
+{
+    Entry& e = s.ring[slot];
+
+    s.map.erase(e.key);
+    s.bytes -= e.bytes;
+    av_frame_free(&e.frame);
+    e.key.source.clear();
+    e.bytes = 0;
+    e.referenced = false;
+    s.freeSlots.push_back(slot);
+}
+
+void VFrameCache::evict(Shard& s, size_t need)
+{
+    /* two turns of the hand clear every reference bit, so this ends */
+    while (s.bytes + need > shardBudget_ && !s.map.empty()) {
+        if (s.hand >= s.ring.size())
+            s.hand = 0;
+        Entry& e = s.ring[s.hand];
+        if (e.frame && e.referenced) {
+            e.referenced = false;
+        } else if (e.frame) {
+            release(s, s.hand);
+            evictions_++;
+        }
+        s.hand++;
+    }
+}
+
+void VFrameCache::setLength(const std::string& source, int64_t frames)
+{
+    std::lock_guard<std::mutex> lock(lengthMutex_);
+    lengths_[source] = frames;
+}
+
+int64_t VFrameCache::getLength(const std::string& source)
+{
+    std::lock_guard<std::mutex> lock(lengthMutex_);
+    auto it = lengths_.find(source);
+    return it == lengths_.end() ? -1 : it->second;
+}
+
+void VFrameCache::clear()
+{
+    for (size_t i = 0; i < shards_.size(); i++) {
+        Shard& s = shards_[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (size_t j = 0; j < s.ring.size(); j++)
+            av_frame_free(&s.ring[j].frame);
+        s.map.clear();
+        s.ring.clear();
+        s.freeSlots.clear();
+        s.hand = 0;
+        s.bytes = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(lengthMutex_);
+    lengths_.clear();
+}
+
+size_t VFrameCache::getBytes()
+{
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        bytes += shards_[i].bytes;
+    }
+    return bytes;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "frame.hpp"
+
+struct AVFrame;
+
+// Decoded frames kept in memory across epochs, keyed by (source, frame index),
+// within a byte budget. Entries hold references to the frame buffers, nothing is
+// copied in or out, so a cached frame must not be written to. The key space is
+// split over shards, each with its own lock, budget and CLOCK hand: a hit only
+// sets the entry's reference bit, eviction sweeps the shard and drops the first
+// entry not used since the previous sweep. Decode workers on different keys
+// rarely touch the same shard. Safe to use from several threads.
+class VFrameCache
+{
+public:
+    explicit VFrameCache(size_t budget, int shards=16);
+    ~VFrameCache();
+
+    // new references to the cached planes on a hit
+    bool lookup(const std::string& source, int64_t index, AVFrame* frame);
+    bool lookup(const std::string& source, int64_t index, VFrame* f);
+    // host frames only; replaces an entry with the same key, frames larger
+    // than a shard's budget are not cached
+    int insert(const std::string& source, int64_t index, const AVFrame* frame);
+    int insert(const std::string& source, int64_t index, VFrame* f);
+
+    // number of frames in source once it was decoded to the end, -1 if unknown
+    void setLength(const std::string& source, int64_t frames);
+    int64_t getLength(const std::string& source);
+
+    void clear();
+    size_t getBytes();
+    size_t getBudget() { return budget_; }
+    uint64_t getHits() { return hits_.load(); }
+    uint64_t getMisses() { return misses_.load(); }
+    uint64_t getEvictions() { return evictions_.load(); }
+
+private:
+    struct Key
+    {
+        std::string source;
+        int64_t index;
+        bool operator==(const Key& o) const { return index == o.index && source == o.source; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& k) const
+        {
+            return std::hash<std::string>()(k.source) ^ ((size_t)k.index * 0x9E3779B97F4A7C15ULL);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        AVFrame *frame = nullptr;
+        size_t bytes = 0;
+        bool referenced = false;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<Key, size_t, KeyHash> map;
+        // CLOCK ring, slots of evicted entries are reused
+        std::vector<Entry> ring;
+        std::vector<size_t> freeSlots;
+        size_t hand = 0;
+        size_t bytes = 0;
+    };
+
+    Shard& getShard(const Key& key) { return shards_[KeyHash()(key) % shards_.size()]; }
+    void evict(Shard& s, size_t need);
+    void release(Shard& s, size_t slot);
+
+private:
+    size_t budget_;
+    size_t shardBudget_;
+    std::vector<Shard> shards_;
+    std::mutex lengthMutex_;
+    std::unordered_map<std::string, int64_t> lengths_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+};
@@ -0,0 +1,337 @@
+#include "catalog.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// file layout: header, then records of VCatalogRecord, the path, the extradata
+// and padding to 8 bytes
+struct VCatalogHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t infoSize;
+    uint32_t reserved;
+};
+
+struct VCatalogRecord
+{
+    uint32_t size;
+    uint32_t pathSize;
+    uint32_t extraSize;
+    uint32_t reserved;
+    int64_t srcSize;
+    int64_t srcMtime;
+    VStreamInfo info;
+};
+
+static const char catalogMagic[4] = { 'V', 'C', 'A', 'T' };
+static const uint32_t catalogVersion = 1;
+
+static bool validRecord(const VCatalogRecord& rec)
+{
+    return rec.size % 8 == 0 && rec.pathSize > 0 && rec.reserved == 0 &&
+           rec.size >= sizeof(rec) + (size_t)rec.pathSize + rec.extraSize &&
+           rec.info.stream >= 0 && rec.info.stream < rec.info.nbStreams &&
+           !rec.info.format[sizeof(rec.info.format) - 1];
+}
+
+VCatalog::VCatalog(const char* path) :
+    path_(path)
+{
+}
+
+VCatalog::~VCatalog()
+{
+    unmap();
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+void VCatalog::unmap()
+{
+    if (map_) {
+        munmap(map_, mapSize_);
+        map_ = nullptr;
+        mapSize_ = 0;
+    }
+}
+
+int VCatalog::open()
+{
+    struct stat st;
+    VCatalogHeader hdr = {};
+    int ret = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ >= 0)
+        return 0;
+
+    if ((fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        fprintf(stderr, "Cannot open catalogue %s\n", path_.c_str());
+        return -1;
+    }
+
+    /* the first process to get here writes the header */
+    memcpy(hdr.magic, catalogMagic, 4);
+    hdr.version = catalogVersion;
+    hdr.infoSize = sizeof(VStreamInfo);
+    flock(fd_, LOCK_EX);
+    if (fstat(fd_, &st) < 0 || (st.st_size == 0 && write(fd_, &hdr, sizeof(hdr)) != sizeof(hdr)))
+        ret = -1;
+    flock(fd_, LOCK_UN);
+
+    if (ret < 0 || refresh() < 0) {
+        fprintf(stderr, "Cannot read catalogue %s\n", path_.c_str());
+        unmap();
+        close(fd_);
+        fd_ = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int VCatalog::refresh()
+{
+    struct stat st;
+    const VCatalogHeader *hdr = nullptr;
+    bool corrupt = false;
+
+    if (fstat(fd_, &st) < 0)
+        return -1;
+    if ((size_t)st.st_size <= mapSize_)
+        return 0;
+
+    /* the file only grows, remap it and index the records added since */
+    unmap();
+    map_ = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        return -1;
+    }
+    mapSize_ = st.st_size;
+
+    hdr = (const VCatalogHeader*)map_;
+    if (mapSize_ < sizeof(VCatalogHeader) || memcmp(hdr->magic, catalogMagic, 4) ||
+        hdr->version != catalogVersion || hdr->infoSize != sizeof(VStreamInfo))
+        return -1;
+    if (!parsed_)
+        parsed_ = sizeof(VCatalogHeader);
+
+    /* a record still being appended is picked up on the next refresh; past a
+       corrupt one (the torn append of a writer that died), the next record
+       that makes sense is looked for byte by byte */
+    while (parsed_ + sizeof(VCatalogRecord) <= mapSize_) {
+        VCatalogRecord rec;
+        memcpy(&rec, (const uint8_t*)map_ + parsed_, sizeof(rec));
+        if (!validRecord(rec)) {
+            if (!corrupt)
+                fprintf(stderr, "Corrupt record in catalogue %s, skipping it\n", path_.c_str());
+            corrupt = true;
+            parsed_++;
+            continue;
+        }
+        if (parsed_ + rec.size > mapSize_)
+            break;
+        corrupt = false;
+        offsets_[std::string((const char*)map_ + parsed_ + sizeof(rec), rec.pathSize)] = parsed_;
+        parsed_ += rec.size;
+    }
+
+    return 0;
+}
+
+bool VCatalog::find(const char* path, int64_t size, int64_t mtime,
+                    VStreamInfo* info, std::vector<uint8_t>* extradata)
+{
+    const VCatalogRecord *rec = nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0)
+        return false;
+
+    for (int pass = 0; pass < 2 && !rec; pass++) {
+        /* on a miss, look for records other workers appended meanwhile */
+        if (pass && refresh() < 0)
+            return false;
+        auto it = offsets_.find(path);
+        if (it == offsets_.end())
+            continue;
+        rec = (const VCatalogRecord*)((const uint8_t*)map_ + it->second);
+        if (rec->srcSize != size || rec->srcMtime != mtime)
+            rec = nullptr;
+    }
+    if (!rec)
+        return false;
+
+    *info = rec->info;
+    const uint8_t *extra = (const uint8_t*)(rec + 1) + rec->pathSize;
+    extradata->assign(extra, extra + rec->extraSize);
+    return true;
+}
+
+int VCatalog::add(const char* path, int64_t size, int64_t mtime,
+                  const VStreamInfo& info, const std::vector<uint8_t>& extradata)
+{
+    VCatalogRecord rec = {};
+    std::vector<uint8_t> buf;
+    size_t pathSize = strlen(path);
+    ssize_t written = 0;
+    off_t end = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ < 0)
+        return -1;
+
+    rec.pathSize = pathSize;
+    rec.extraSize = extradata.size();
+    rec.size = (sizeof(rec) + pathSize + extradata.size() + 7) & ~7;
+    rec.srcSize = size;
+    rec.srcMtime = mtime;
+    rec.info = info;
+
+    buf.resize(rec.size);
+    memcpy(buf.data(), &rec, sizeof(rec));
+    memcpy(buf.data() + sizeof(rec), path, pathSize);
+    if (!extradata.empty())
+        memcpy(buf.data() + sizeof(rec) + pathSize, extradata.data(), extradata.size());
+
+    /* one append per record, serialized with the other writers; a short
+       write is cut off again so the next record does not follow a torn one */
+    flock(fd_, LOCK_EX);
+    if ((end = lseek(fd_, 0, SEEK_END)) >= 0) {
+        written = write(fd_, buf.data(), buf.size());
+        if (written != (ssize_t)buf.size() && ftruncate(fd_, end) < 0)
+            fprintf(stderr, "Cannot truncate catalogue %s\n", path_.c_str());
+    }
+    flock(fd_, LOCK_UN);
+    if (written != (ssize_t)buf.size()) {
+        fprintf(stderr, "Cannot write catalogue %s\n", path_.c_str());
+        return -1;
+    }
+
+    return refresh();
+}
+
+size_t VCatalog::getCount()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return offsets_.size();
+}
+
+int VCatalog::capture(const AVFormatContext* ctx, int stream,
+                      VStreamInfo* info, std::vector<uint8_t>* extradata)
+{
+    const AVStream *st = nullptr;
+    const AVCodecParameters *par = nullptr;
+    size_t len = 0;
+
+    if (stream < 0 || stream >= (int)ctx->nb_streams || !ctx->iformat)
+        return AVERROR(EINVAL);
+    st = ctx->streams[stream];
+    par = st->codecpar;
+
+    memset(info, 0, sizeof(*info));
+    /* iformat->name lists aliases ("mov,mp4,..."), only the first one is looked up */
+    len = strcspn(ctx->iformat->name, ",");
+    if (len >= sizeof(info->format))
+        return AVERROR(EINVAL);
+    memcpy(info->format, ctx->iformat->name, len);
+
+    info->nbStreams = ctx->nb_streams;
+    info->stream = stream;
+    info->timeBase[0] = st->time_base.num;
+    info->timeBase[1] = st->time_base.den;
+    info->avgFrameRate[0] = st->avg_frame_rate.num;
+    info->avgFrameRate[1] = st->avg_frame_rate.den;
+    info->rFrameRate[0] = st->r_frame_rate.num;
+    info->rFrameRate[1] = st->r_frame_rate.den;
+    info->sampleAspect[0] = st->sample_aspect_ratio.num;
+    info->sampleAspect[1] = st->sample_aspect_ratio.den;
+    info->startTime = st->start_time;
+    info->duration = st->duration;
+    info->nbFrames = st->nb_frames;
+    info->bitRate = par->bit_rate;
+    info->codecTag = par->codec_tag;
+    info->codecId = par->codec_id;
+    info->pixFormat = par->format;
+    info->profile = par->profile;
+    info->level = par->level;
+    info->width = par->width;
+    info->height = par->height;
+    info->fieldOrder = par->field_order;
+    info->colorRange = par->color_range;
+    info->colorPrimaries = par->color_primaries;
+    info->colorTrc = par->color_trc;
+    info->colorSpace = par->color_space;
+    info->chromaLocation = par->chroma_location;
+    info->videoDelay = par->video_delay;
+    info->bitsPerCodedSample = par->bits_per_coded_sample;
+    info->bitsPerRawSample = par->bits_per_raw_sample;
+
+    extradata->assign(par->extradata, par->extradata + par->extradata_size);
+    return 0;
+}
+
+int VCatalog::apply(AVFormatContext* ctx, const VStreamInfo& info,
+                    const std::vector<uint8_t>& extradata)
+{
+    AVStream *st = nullptr;
+    AVCodecParameters *par = nullptr;
+
+    /* the demuxer's header must describe the same streams as when the record was made */
+    if ((int)ctx->nb_streams != info.nbStreams || info.stream < 0 ||
+        info.stream >= (int)ctx->nb_streams)
+        return AVERROR(EINVAL);
+    st = ctx->streams[info.stream];
+    par = st->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO || par->codec_id != info.codecId)
+        return AVERROR(EINVAL);
+
+    st->avg_frame_rate = av_make_q(info.avgFrameRate[0], info.avgFrameRate[1]);
+    st->r_frame_rate = av_make_q(info.rFrameRate[0], info.rFrameRate[1]);
+    st->sample_aspect_ratio = av_make_q(info.sampleAspect[0], info.sampleAspect[1]);
+    if (st->start_time == AV_NOPTS_VALUE)
+        st->start_time = info.startTime;
+    if (st->duration == AV_NOPTS_VALUE)
+        st->duration = info.duration;
+    if (!st->nb_frames)
+        st->nb_frames = info.nbFrames;
+
+    par->bit_rate = info.bitRate;
+    par->codec_tag = info.codecTag;
+    par->format = info.pixFormat;
+    par->profile = info.profile;
+    par->level = info.level;
+    par->width = info.width;
+    par->height = info.height;
+    par->field_order = (AVFieldOrder)info.fieldOrder;
+    par->color_range = (AVColorRange)info.colorRange;
+    par->color_primaries = (AVColorPrimaries)info.colorPrimaries;
+    par->color_trc = (AVColorTransferCharacteristic)info.colorTrc;
+    par->color_space = (AVColorSpace)info.colorSpace;
+    par->chroma_location = (AVChromaLocation)info.chromaLocation;
+    par->video_delay = info.videoDelay;
+    par->bits_per_coded_sample = info.bitsPerCodedSample;
+    par->bits_per_raw_sample = info.bitsPerRawSample;
+
+    /* same size is not the same header, compare the bytes too */
+    if (!extradata.empty() && (par->extradata_size != (int)extradata.size() ||
+                               memcmp(par->extradata, extradata.data(), extradata.size()))) {
+        av_freep(&par->extradata);
+        par->extradata_size = 0;
+        if (!(par->extradata = (uint8_t*)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE)))
+            return AVERROR(ENOMEM);
+        memcpy(par->extradata, extradata.data(), extradata.size());
+        par->extradata_size = extradata.size();
+    }
+
+    return 0;
+}
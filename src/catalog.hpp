@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct AVFormatContext;
+
+// What VAccel::init() takes from avformat_find_stream_info() for the video
+// stream. The layout is fixed, it is stored as is in the catalogue.
+struct VStreamInfo
+{
+    char format[32];        // demuxer short name, opening with it skips probing
+    int32_t nbStreams;
+    int32_t stream;
+    int32_t timeBase[2];
+    int32_t avgFrameRate[2];
+    int32_t rFrameRate[2];
+    int32_t sampleAspect[2];
+    int64_t startTime;
+    int64_t duration;
+    int64_t nbFrames;
+    int64_t bitRate;
+    uint32_t codecTag;
+    int32_t codecId;
+    int32_t pixFormat;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    int32_t fieldOrder;
+    int32_t colorRange;
+    int32_t colorPrimaries;
+    int32_t colorTrc;
+    int32_t colorSpace;
+    int32_t chromaLocation;
+    int32_t videoDelay;
+    int32_t bitsPerCodedSample;
+    int32_t bitsPerRawSample;
+};
+
+// Append-only file of stream info records keyed by (path, size, mtime), shared
+// by every worker and process that decodes the same dataset. A hit lets init()
+// open the file with a known demuxer and skip avformat_find_stream_info(); a
+// miss probes normally and appends the result. Records are appended under an
+// flock, other processes' records are picked up on the next miss. A short
+// append is cut off again, and a damaged record is skipped rather than hiding
+// the ones after it. Safe to use from several threads.
+class VCatalog
+{
+public:
+    explicit VCatalog(const char* path);
+    ~VCatalog();
+
+    // map the records already in the file, creating it when missing
+    int open();
+    // false when there is no entry or it is stale against size/mtime
+    bool find(const char* path, int64_t size, int64_t mtime,
+              VStreamInfo* info, std::vector<uint8_t>* extradata);
+    int add(const char* path, int64_t size, int64_t mtime,
+            const VStreamInfo& info, const std::vector<uint8_t>& extradata);
+    size_t getCount();
+
+    // between a record and an AVFormatContext; apply() expects a context
+    // that avformat_open_input() opened and fails when the streams it found
+    // do not match the record
+    static int capture(const AVFormatContext* ctx, int stream,
+                       VStreamInfo* info, std::vector<uint8_t>* extradata);
+    static int apply(AVFormatContext* ctx, const VStreamInfo& info,
+                     const std::vector<uint8_t>& extradata);
+
+private:
+    int refresh();
+    void unmap();
+
+private:
+    std::string path_;
+    int fd_ = -1;
+    void *map_ = nullptr;
+    size_t mapSize_ = 0;
+    size_t parsed_ = 0;
+    // path to the offset of its latest record in the file
+    std::unordered_map<std::string, size_t> offsets_;
+    std::mutex mutex_;
+};
@@ -0,0 +1,433 @@
+#include "convert.hpp"
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+struct ColorCoeffs
+{
+    float ys, yo;
+    float rv, gu, gv, bu;
+};
+
+// everything one row kernel needs: source rows, colour matrix, per-channel
+// scale/bias applied after clamping, and the destination of this row
+struct RowArgs
+{
+    const uint8_t *y, *u, *v;
+    int uvStep;
+    int width;
+    ColorCoeffs c;
+    float scale[3];
+    float bias[3];
+    VLayout layout;
+    VDataType dtype;
+    uint8_t *dst[3];
+};
+
+typedef void (*RowFn)(const RowArgs& a);
+
+static void getCoeffs(const AVFrame* frame, ColorCoeffs* c)
+{
+    bool full = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+    bool bt709 = frame->colorspace == AVCOL_SPC_BT709;
+    float kr = bt709 ? 0.2126f : 0.299f;
+    float kb = bt709 ? 0.0722f : 0.114f;
+    float cs = full ? 1.0f : 255.0f / 224.0f;
+
+    c->ys = full ? 1.0f : 255.0f / 219.0f;
+    c->yo = full ? 0.0f : 16.0f;
+    c->rv = 2 * (1 - kr) * cs;
+    c->bu = 2 * (1 - kb) * cs;
+    c->gu = -2 * (1 - kb) * kb / (1 - kr - kb) * cs;
+    c->gv = -2 * (1 - kr) * kr / (1 - kr - kb) * cs;
+}
+
+static inline float clip255(float v)
+{
+    return v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+}
+
+static uint16_t floatToHalf(float f)
+{
+    uint32_t x, h, rem, half;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if (exp >= 31)
+        return sign | 0x7c00 | ((((x >> 23) & 0xff) == 0xff && mant) ? 0x200 : 0);
+    if (exp <= 0) {
+        if (exp < -10)
+            return sign;
+        uint32_t shift = 14 - exp;
+        mant |= 0x800000;
+        h = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return sign | h;
+    }
+
+    /* round to nearest even, a carry correctly bumps the exponent */
+    h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return h;
+}
+
+/* store count already converted pixels starting at column x, any layout/dtype */
+static void storePixels(const RowArgs& a, int x, int count, const float* r, const float* g, const float* b)
+{
+    const float *rgb[3] = { r, g, b };
+
+    for (int i = 0; i < count; i++) {
+        for (int ch = 0; ch < 3; ch++) {
+            float v = rgb[ch][i] * a.scale[ch] + a.bias[ch];
+            size_t idx = (a.layout == VLAYOUT_NCHW) ? (size_t)(x + i) : (size_t)(x + i) * 3 + ch;
+            uint8_t *dst = (a.layout == VLAYOUT_NCHW) ? a.dst[ch] : a.dst[0];
+
+            switch (a.dtype) {
+            case VDTYPE_FP16:
+                ((uint16_t*)dst)[idx] = floatToHalf(v);
+                break;
+            case VDTYPE_FP32:
+                ((float*)dst)[idx] = v;
+                break;
+            default:
+                dst[idx] = (uint8_t)(v + 0.5f);
+                break;
+            }
+        }
+    }
+}
+
+static void rowScalar(const RowArgs& a, int start)
+{
+    float r[16], g[16], b[16];
+
+    for (int x = start; x < a.width; x += 16) {
+        int count = (a.width - x < 16) ? a.width - x : 16;
+        for (int i = 0; i < count; i++) {
+            float yf = (a.y[x + i] - a.c.yo) * a.c.ys;
+            float uf = a.u[((x + i) >> 1) * a.uvStep] - 128.0f;
+            float vf = a.v[((x + i) >> 1) * a.uvStep] - 128.0f;
+
+            r[i] = clip255(yf + a.c.rv * vf);
+            g[i] = clip255(yf + a.c.gu * uf + a.c.gv * vf);
+            b[i] = clip255(yf + a.c.bu * uf);
+        }
+        storePixels(a, x, count, r, g, b);
+    }
+}
+
+static void rowC(const RowArgs& a)
+{
+    rowScalar(a, 0);
+}
+
+#ifdef CONVERT_X86
+
+/*
+ * Each kernel converts a whole row in one pass: load luma and the (duplicated)
+ * chroma, matrix to RGB, clamp, normalise and store. NCHW outputs are written
+ * with vector stores, NHWC interleaving goes through a small on-stack block.
+ * The odd tail of the row falls back to the scalar code.
+ */
+
+__attribute__((target("sse4.1")))
+static void rowSse4(const RowArgs& a)
+{
+    const __m128 yo = _mm_set1_ps(a.c.yo), ys = _mm_set1_ps(a.c.ys);
+    const __m128 rv = _mm_set1_ps(a.c.rv), gu = _mm_set1_ps(a.c.gu);
+    const __m128 gv = _mm_set1_ps(a.c.gv), bu = _mm_set1_ps(a.c.bu);
+    const __m128 c128 = _mm_set1_ps(128.0f), zero = _mm_setzero_ps(), c255 = _mm_set1_ps(255.0f);
+    const __m128 sr = _mm_set1_ps(a.scale[0]), sg = _mm_set1_ps(a.scale[1]), sb = _mm_set1_ps(a.scale[2]);
+    const __m128 br = _mm_set1_ps(a.bias[0]), bg = _mm_set1_ps(a.bias[1]), bb = _mm_set1_ps(a.bias[2]);
+    /* pick the two chroma samples of 4 pixels and widen them to 32 bit, duplicated */
+    const __m128i dup = (a.uvStep == 2) ?
+        _mm_setr_epi8(0, -1, -1, -1, 0, -1, -1, -1, 2, -1, -1, -1, 2, -1, -1, -1) :
+        _mm_setr_epi8(0, -1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 1, -1, -1, -1);
+    alignas(16) float r[4], g[4], b[4];
+    int x = 0;
+
+    for (; x + 4 <= a.width; x += 4) {
+        int32_t yw = 0, uw = 0, vw = 0;
+        memcpy(&yw, a.y + x, 4);
+        memcpy(&uw, a.u + (x >> 1) * a.uvStep, a.uvStep + 1);
+        memcpy(&vw, a.v + (x >> 1) * a.uvStep, a.uvStep + 1);
+
+        __m128 yf = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(yw))), yo), ys);
+        __m128 uf = _mm_sub_ps(_mm_cvtepi32_ps(_mm_shuffle_epi8(_mm_cvtsi32_si128(uw), dup)), c128);
+        __m128 vf = _mm_sub_ps(_mm_cvtepi32_ps(_mm_shuffle_epi8(_mm_cvtsi32_si128(vw), dup)), c128);
+
+        __m128 rf = _mm_add_ps(yf, _mm_mul_ps(rv, vf));
+        __m128 gf = _mm_add_ps(yf, _mm_add_ps(_mm_mul_ps(gu, uf), _mm_mul_ps(gv, vf)));
+        __m128 bf = _mm_add_ps(yf, _mm_mul_ps(bu, uf));
+        rf = _mm_min_ps(_mm_max_ps(rf, zero), c255);
+        gf = _mm_min_ps(_mm_max_ps(gf, zero), c255);
+        bf = _mm_min_ps(_mm_max_ps(bf, zero), c255);
+
+        if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_FP32) {
+            _mm_storeu_ps((float*)a.dst[0] + x, _mm_add_ps(_mm_mul_ps(rf, sr), br));
+            _mm_storeu_ps((float*)a.dst[1] + x, _mm_add_ps(_mm_mul_ps(gf, sg), bg));
+            _mm_storeu_ps((float*)a.dst[2] + x, _mm_add_ps(_mm_mul_ps(bf, sb), bb));
+        } else if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_U8) {
+            __m128i ri = _mm_cvtps_epi32(rf), gi = _mm_cvtps_epi32(gf), bi = _mm_cvtps_epi32(bf);
+            int32_t rw = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(ri, ri), ri));
+            int32_t gw = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(gi, gi), gi));
+            int32_t bw = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(bi, bi), bi));
+            memcpy(a.dst[0] + x, &rw, 4);
+            memcpy(a.dst[1] + x, &gw, 4);
+            memcpy(a.dst[2] + x, &bw, 4);
+        } else {
+            _mm_store_ps(r, rf);
+            _mm_store_ps(g, gf);
+            _mm_store_ps(b, bf);
+            storePixels(a, x, 4, r, g, b);
+        }
+    }
+
+    rowScalar(a, x);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void rowAvx2(const RowArgs& a)
+{
+    const __m256 yo = _mm256_set1_ps(a.c.yo), ys = _mm256_set1_ps(a.c.ys);
+    const __m256 rv = _mm256_set1_ps(a.c.rv), gu = _mm256_set1_ps(a.c.gu);
+    const __m256 gv = _mm256_set1_ps(a.c.gv), bu = _mm256_set1_ps(a.c.bu);
+    const __m256 c128 = _mm256_set1_ps(128.0f), zero = _mm256_setzero_ps(), c255 = _mm256_set1_ps(255.0f);
+    const __m256 sr = _mm256_set1_ps(a.scale[0]), sg = _mm256_set1_ps(a.scale[1]), sb = _mm256_set1_ps(a.scale[2]);
+    const __m256 br = _mm256_set1_ps(a.bias[0]), bg = _mm256_set1_ps(a.bias[1]), bb = _mm256_set1_ps(a.bias[2]);
+    /* 4 chroma samples of 8 pixels, each repeated for two pixels */
+    const __m256i dup = (a.uvStep == 2) ? _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6) :
+                                          _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    alignas(32) float r[8], g[8], b[8];
+    int x = 0;
+
+    for (; x + 8 <= a.width; x += 8) {
+        uint8_t uw[8] = {}, vw[8] = {};
+        memcpy(uw, a.u + (x >> 1) * a.uvStep, 4 * a.uvStep - (a.uvStep - 1));
+        memcpy(vw, a.v + (x >> 1) * a.uvStep, 4 * a.uvStep - (a.uvStep - 1));
+
+        __m256 yf = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(a.y + x))));
+        __m256 uf = _mm256_cvtepi32_ps(_mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)uw)), dup));
+        __m256 vf = _mm256_cvtepi32_ps(_mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)vw)), dup));
+        yf = _mm256_mul_ps(_mm256_sub_ps(yf, yo), ys);
+        uf = _mm256_sub_ps(uf, c128);
+        vf = _mm256_sub_ps(vf, c128);
+
+        __m256 rf = _mm256_fmadd_ps(rv, vf, yf);
+        __m256 gf = _mm256_fmadd_ps(gu, uf, _mm256_fmadd_ps(gv, vf, yf));
+        __m256 bf = _mm256_fmadd_ps(bu, uf, yf);
+        rf = _mm256_min_ps(_mm256_max_ps(rf, zero), c255);
+        gf = _mm256_min_ps(_mm256_max_ps(gf, zero), c255);
+        bf = _mm256_min_ps(_mm256_max_ps(bf, zero), c255);
+
+        if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_FP32) {
+            _mm256_storeu_ps((float*)a.dst[0] + x, _mm256_fmadd_ps(rf, sr, br));
+            _mm256_storeu_ps((float*)a.dst[1] + x, _mm256_fmadd_ps(gf, sg, bg));
+            _mm256_storeu_ps((float*)a.dst[2] + x, _mm256_fmadd_ps(bf, sb, bb));
+        } else if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_FP16) {
+            _mm_storeu_si128((__m128i*)((uint16_t*)a.dst[0] + x),
+                             _mm256_cvtps_ph(_mm256_fmadd_ps(rf, sr, br), _MM_FROUND_TO_NEAREST_INT));
+            _mm_storeu_si128((__m128i*)((uint16_t*)a.dst[1] + x),
+                             _mm256_cvtps_ph(_mm256_fmadd_ps(gf, sg, bg), _MM_FROUND_TO_NEAREST_INT));
+            _mm_storeu_si128((__m128i*)((uint16_t*)a.dst[2] + x),
+                             _mm256_cvtps_ph(_mm256_fmadd_ps(bf, sb, bb), _MM_FROUND_TO_NEAREST_INT));
+        } else if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_U8) {
+            __m256i ri = _mm256_cvtps_epi32(rf), gi = _mm256_cvtps_epi32(gf), bi = _mm256_cvtps_epi32(bf);
+            __m128i r16 = _mm_packus_epi32(_mm256_castsi256_si128(ri), _mm256_extracti128_si256(ri, 1));
+            __m128i g16 = _mm_packus_epi32(_mm256_castsi256_si128(gi), _mm256_extracti128_si256(gi, 1));
+            __m128i b16 = _mm_packus_epi32(_mm256_castsi256_si128(bi), _mm256_extracti128_si256(bi, 1));
+            _mm_storel_epi64((__m128i*)(a.dst[0] + x), _mm_packus_epi16(r16, r16));
+            _mm_storel_epi64((__m128i*)(a.dst[1] + x), _mm_packus_epi16(g16, g16));
+            _mm_storel_epi64((__m128i*)(a.dst[2] + x), _mm_packus_epi16(b16, b16));
+        } else {
+            _mm256_store_ps(r, rf);
+            _mm256_store_ps(g, gf);
+            _mm256_store_ps(b, bf);
+            storePixels(a, x, 8, r, g, b);
+        }
+    }
+
+    rowScalar(a, x);
+}
+
+__attribute__((target("avx512f")))
+static void rowAvx512(const RowArgs& a)
+{
+    const __m512 yo = _mm512_set1_ps(a.c.yo), ys = _mm512_set1_ps(a.c.ys);
+    const __m512 rv = _mm512_set1_ps(a.c.rv), gu = _mm512_set1_ps(a.c.gu);
+    const __m512 gv = _mm512_set1_ps(a.c.gv), bu = _mm512_set1_ps(a.c.bu);
+    const __m512 c128 = _mm512_set1_ps(128.0f), zero = _mm512_setzero_ps(), c255 = _mm512_set1_ps(255.0f);
+    const __m512 sr = _mm512_set1_ps(a.scale[0]), sg = _mm512_set1_ps(a.scale[1]), sb = _mm512_set1_ps(a.scale[2]);
+    const __m512 br = _mm512_set1_ps(a.bias[0]), bg = _mm512_set1_ps(a.bias[1]), bb = _mm512_set1_ps(a.bias[2]);
+    /* 8 chroma samples of 16 pixels, each repeated for two pixels */
+    const __m512i dup = (a.uvStep == 2) ?
+        _mm512_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14) :
+        _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7);
+    alignas(64) float r[16], g[16], b[16];
+    int x = 0;
+
+    for (; x + 16 <= a.width; x += 16) {
+        uint8_t uw[16] = {}, vw[16] = {};
+        memcpy(uw, a.u + (x >> 1) * a.uvStep, 8 * a.uvStep - (a.uvStep - 1));
+        memcpy(vw, a.v + (x >> 1) * a.uvStep, 8 * a.uvStep - (a.uvStep - 1));
+
+        __m512 yf = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(a.y + x))));
+        __m512 uf = _mm512_cvtepi32_ps(_mm512_permutexvar_epi32(dup, _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)uw))));
+        __m512 vf = _mm512_cvtepi32_ps(_mm512_permutexvar_epi32(dup, _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)vw))));
+        yf = _mm512_mul_ps(_mm512_sub_ps(yf, yo), ys);
+        uf = _mm512_sub_ps(uf, c128);
+        vf = _mm512_sub_ps(vf, c128);
+
+        __m512 rf = _mm512_fmadd_ps(rv, vf, yf);
+        __m512 gf = _mm512_fmadd_ps(gu, uf, _mm512_fmadd_ps(gv, vf, yf));
+        __m512 bf = _mm512_fmadd_ps(bu, uf, yf);
+        rf = _mm512_min_ps(_mm512_max_ps(rf, zero), c255);
+        gf = _mm512_min_ps(_mm512_max_ps(gf, zero), c255);
+        bf = _mm512_min_ps(_mm512_max_ps(bf, zero), c255);
+
+        if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_FP32) {
+            _mm512_storeu_ps((float*)a.dst[0] + x, _mm512_fmadd_ps(rf, sr, br));
+            _mm512_storeu_ps((float*)a.dst[1] + x, _mm512_fmadd_ps(gf, sg, bg));
+            _mm512_storeu_ps((float*)a.dst[2] + x, _mm512_fmadd_ps(bf, sb, bb));
+        } else if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_FP16) {
+            _mm256_storeu_si256((__m256i*)((uint16_t*)a.dst[0] + x),
+                                _mm512_cvtps_ph(_mm512_fmadd_ps(rf, sr, br), _MM_FROUND_TO_NEAREST_INT));
+            _mm256_storeu_si256((__m256i*)((uint16_t*)a.dst[1] + x),
+                                _mm512_cvtps_ph(_mm512_fmadd_ps(gf, sg, bg), _MM_FROUND_TO_NEAREST_INT));
+            _mm256_storeu_si256((__m256i*)((uint16_t*)a.dst[2] + x),
+                                _mm512_cvtps_ph(_mm512_fmadd_ps(bf, sb, bb), _MM_FROUND_TO_NEAREST_INT));
+        } else if (a.layout == VLAYOUT_NCHW && a.dtype == VDTYPE_U8) {
+            _mm_storeu_si128((__m128i*)(a.dst[0] + x), _mm512_cvtusepi32_epi8(_mm512_cvtps_epi32(rf)));
+            _mm_storeu_si128((__m128i*)(a.dst[1] + x), _mm512_cvtusepi32_epi8(_mm512_cvtps_epi32(gf)));
+            _mm_storeu_si128((__m128i*)(a.dst[2] + x), _mm512_cvtusepi32_epi8(_mm512_cvtps_epi32(bf)));
+        } else {
+            _mm512_store_ps(r, rf);
+            _mm512_store_ps(g, gf);
+            _mm512_store_ps(b, bf);
+            storePixels(a, x, 16, r, g, b);
+        }
+    }
+
+    rowScalar(a, x);
+}
+
+static bool hasF16c()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_F16C) != 0;
+}
+
+#endif
+
+static RowFn selectRowFn(const char** name)
+{
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        *name = "avx512";
+        return rowAvx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && hasF16c()) {
+        *name = "avx2";
+        return rowAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        *name = "sse4";
+        return rowSse4;
+    }
+#endif
+    *name = "c";
+    return rowC;
+}
+
+static const char* isaName = nullptr;
+
+static RowFn getRowFn()
+{
+    /* resolved once, function-local static init is thread safe */
+    static RowFn fn = selectRowFn(&isaName);
+    return fn;
+}
+
+const char* convertIsa()
+{
+    getRowFn();
+    return isaName;
+}
+
+int convertFrame(const AVFrame* frame, uint8_t* dst, VLayout layout, VDataType dtype,
+                 const float* mean, const float* std)
+{
+    RowFn fn = getRowFn();
+    size_t esize = (dtype == VDTYPE_FP32) ? 4 : ((dtype == VDTYPE_FP16) ? 2 : 1);
+    size_t plane = (size_t)frame->width * frame->height * esize;
+    RowArgs a;
+
+    switch (frame->format) {
+    case AV_PIX_FMT_NV12:
+        a.uvStep = 2;
+        break;
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        a.uvStep = 1;
+        break;
+    default:
+        fprintf(stderr, "Unsupported pixel format %d for tensor output\n", frame->format);
+        return AVERROR(ENOSYS);
+    }
+
+    getCoeffs(frame, &a.c);
+    a.width = frame->width;
+    a.layout = layout;
+    a.dtype = dtype;
+    for (int ch = 0; ch < 3; ch++) {
+        if (dtype == VDTYPE_U8) {
+            a.scale[ch] = 1.0f;
+            a.bias[ch] = 0.0f;
+        } else {
+            /* (v / 255 - mean) / std folded into one multiply-add */
+            float m = mean ? mean[ch] : 0.0f;
+            float s = std ? std[ch] : 1.0f;
+            a.scale[ch] = 1.0f / (255.0f * s);
+            a.bias[ch] = -m / s;
+        }
+    }
+
+    for (int row = 0; row < frame->height; row++) {
+        a.y = frame->data[0] + row * frame->linesize[0];
+        a.u = frame->data[1] + (row >> 1) * frame->linesize[1];
+        a.v = (a.uvStep == 2) ? a.u + 1 : frame->data[2] + (row >> 1) * frame->linesize[2];
+
+        if (layout == VLAYOUT_NCHW) {
+            for (int ch = 0; ch < 3; ch++)
+                a.dst[ch] = dst + ch * plane + (size_t)row * frame->width * esize;
+        } else {
+            a.dst[0] = dst + (size_t)row * frame->width * 3 * esize;
+        }
+
+        fn(a);
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "tensor.hpp"
+
+struct AVFrame;
+
+// Convert a decoded NV12 or I420 frame to planar or packed RGB and store it into
+// one tensor slot of frame->height x frame->width in a single pass. u8 output keeps
+// the 0..255 range; fp16/fp32 output is (v / 255 - mean) / std per channel, with
+// mean 0 and std 1 when they are null. The row kernel (AVX-512, AVX2, SSE4.1 or
+// plain C) is picked once at runtime from the CPU features.
+int convertFrame(const AVFrame* frame, uint8_t* dst, VLayout layout, VDataType dtype,
+                 const float* mean=nullptr, const float* std=nullptr);
+
+// name of the selected row kernel: "avx512", "avx2", "sse4" or "c"
+const char* convertIsa();
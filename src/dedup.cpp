@@ -0,0 +1,136 @@
+#include "dedup.hpp"
+#include <stdio.h>
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/frame.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// sum of n bytes
+static uint32_t sumBytes(const uint8_t* p, int n)
+{
+    uint32_t sum = 0;
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(p + x)), zero));
+    sum = (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+    for (; x < n; x++)
+        sum += p[x];
+
+    return sum;
+}
+
+VDedup::VDedup(float threshold) :
+    threshold_(threshold)
+{
+}
+
+uint32_t VDedup::sad(const uint8_t* a, const uint8_t* b, int n)
+{
+    uint32_t sum = 0;
+    int x = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + x)),
+                                              _mm_loadu_si128((const __m128i*)(b + x))));
+    }
+    sum = (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+    for (; x < n; x++)
+        sum += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+
+    return sum;
+}
+
+int VDedup::signature(const AVFrame* frame, uint8_t* sig)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    int cw = frame->width / grid;
+    int step = 0, offset = 0, shift = 0;
+    bool wide = false;
+
+    if (!desc || desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_RGB) ||
+        cw <= 0 || frame->height < 2 * grid)
+        return AVERROR(EINVAL);
+    /* 8-bit luma is read as is, wider samples (P010, ...) are scaled down to 8 bits */
+    step = desc->comp[0].step;
+    offset = desc->comp[0].offset;
+    shift = desc->comp[0].depth + desc->comp[0].shift - 8;
+    wide = shift > 0;
+    if (wide && (step != 2 || desc->flags & AV_PIX_FMT_FLAG_BE))
+        return AVERROR(EINVAL);
+
+    for (int r = 0; r < grid; r++) {
+        int y0 = r * frame->height / grid;
+        int rows = (r + 1) * frame->height / grid - y0;
+        const uint8_t *top = frame->data[0] + (y0 + rows / 4) * frame->linesize[0];
+        const uint8_t *bottom = frame->data[0] + (y0 + rows * 3 / 4) * frame->linesize[0];
+
+        for (int c = 0; c < grid; c++) {
+            uint32_t sum = 0;
+            if (step == 1) {
+                sum = sumBytes(top + c * cw, cw) + sumBytes(bottom + c * cw, cw);
+            } else if (wide) {
+                for (int x = c * cw; x < (c + 1) * cw; x++)
+                    sum += (AV_RL16(top + 2 * x) >> shift) + (AV_RL16(bottom + 2 * x) >> shift);
+            } else {
+                for (int x = c * cw; x < (c + 1) * cw; x++)
+                    sum += top[x * step + offset] + bottom[x * step + offset];
+            }
+            sig[r * grid + c] = (uint8_t)(sum / (2 * cw));
+        }
+    }
+
+    return 0;
+}
+
+bool VDedup::isDuplicate(const AVFrame* frame)
+{
+    AVFrame *mapped = nullptr;
+    int ret = 0;
+
+    if (frame->hw_frames_ctx) {
+        if (!(mapped = av_frame_alloc()))
+            return false;
+        /* only the sampled rows are read through the mapping */
+        if ((ret = av_hwframe_map(mapped, frame, AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT)) < 0) {
+            av_frame_unref(mapped);
+            ret = av_hwframe_map(mapped, frame, AV_HWFRAME_MAP_READ);
+        }
+        if (ret == 0)
+            ret = signature(mapped, cur_);
+        av_frame_free(&mapped);
+    } else {
+        ret = signature(frame, cur_);
+    }
+    /* frames that cannot be measured are always kept */
+    if (ret < 0) {
+        valid_ = false;
+        return false;
+    }
+
+    if (valid_) {
+        score_ = (float)sad(cur_, last_, grid * grid) / (grid * grid);
+        if (score_ < threshold_)
+            return true;
+    }
+
+    for (int i = 0; i < grid * grid; i++)
+        last_[i] = cur_[i];
+    valid_ = true;
+    return false;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+struct AVFrame;
+
+// Near-duplicate detection for static scenes. Each frame is reduced to a
+// grid x grid signature of mean luma, read from two rows per grid row, and
+// compared (SAD) with the signature of the last frame that was kept. Device
+// surfaces are mapped, not downloaded, so only the sampled rows cross the bus.
+class VDedup
+{
+public:
+    static const int grid = 32;
+
+    // threshold: mean absolute luma difference per cell (0-255) below which
+    // a frame counts as a duplicate
+    explicit VDedup(float threshold);
+
+    // true when frame is within the threshold of the last kept frame,
+    // otherwise frame becomes the new reference
+    bool isDuplicate(const AVFrame* frame);
+    // the next frame is always kept, e.g. after a seek
+    void reset() { valid_ = false; }
+    // difference of the last frame compared, -1 before the first comparison
+    float getLastScore() { return score_; }
+
+    // grid * grid bytes into sig, host frames only
+    static int signature(const AVFrame* frame, uint8_t* sig);
+    static uint32_t sad(const uint8_t* a, const uint8_t* b, int n);
+
+private:
+    float threshold_;
+    float score_ = -1.0f;
+    bool valid_ = false;
+    alignas(16) uint8_t last_[grid * grid];
+    alignas(16) uint8_t cur_[grid * grid];
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// The DLPack ABI (https://github.com/dmlc/dlpack, v0.6 layout) used by
+// VFrame::toDLPack() and VTensor::toDLPack(). When dlpack.h is included first
+// its definitions are used instead; the layouts are identical.
+#ifndef DLPACK_VERSION
+extern "C" {
+
+typedef enum
+{
+    kDLCPU = 1,
+} DLDeviceType;
+
+typedef struct
+{
+    DLDeviceType device_type;
+    int32_t device_id;
+} DLDevice;
+
+typedef enum
+{
+    kDLInt = 0U,
+    kDLUInt = 1U,
+    kDLFloat = 2U,
+} DLDataTypeCode;
+
+typedef struct
+{
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+} DLDataType;
+
+typedef struct
+{
+    void* data;
+    DLDevice device;
+    int32_t ndim;
+    DLDataType dtype;
+    int64_t* shape;
+    int64_t* strides;
+    uint64_t byte_offset;
+} DLTensor;
+
+typedef struct DLManagedTensor
+{
+    DLTensor dl_tensor;
+    void* manager_ctx;
+    void (*deleter)(struct DLManagedTensor* self);
+} DLManagedTensor;
+
+}
+#endif
@@ -0,0 +1,362 @@
+#include "encoder.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+}
+
+VEncoder::VEncoder(const char* outf, const char* type) :
+    outfile_(outf),
+    vatype_(type)
+{
+}
+
+VEncoder::~VEncoder()
+{
+    close();
+    avcodec_free_context(&encoderCtx_);
+    if (outputCtx_) {
+        if (!(outputCtx_->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&outputCtx_->pb);
+        avformat_free_context(outputCtx_);
+    }
+    av_buffer_unref(&hwDeviceCtx_);
+}
+
+int VEncoder::init(const VEncoderOptions& opts)
+{
+    std::string name = opts.codec;
+    bool known = name == "h264" || name == "hevc";
+
+    opts_ = opts;
+    if (opts_.inFlight < 1)
+        opts_.inFlight = 1;
+    sw_ = !strcmp(vatype_, "sw");
+
+    /* "h264"/"hevc" pick the device or the x264/x265 encoder, other names are used as is */
+    if (!sw_ && known) {
+        if (initHw() < 0 || !(encoder_ = avcodec_find_encoder_by_name((name + "_vaapi").c_str()))) {
+            if (!opts_.swFallback) {
+                fprintf(stderr, "No %s encoder for device type %s\n", opts_.codec, vatype_);
+                return -1;
+            }
+            fprintf(stderr, "Falling back to software encoding\n");
+            av_buffer_unref(&hwDeviceCtx_);
+            sw_ = true;
+        }
+    } else if (!sw_) {
+        sw_ = true;
+    }
+
+    if (sw_ && known) {
+        encoder_ = avcodec_find_encoder_by_name(name == "h264" ? "libx264" : "libx265");
+        if (!encoder_)
+            encoder_ = avcodec_find_encoder(name == "h264" ? AV_CODEC_ID_H264 : AV_CODEC_ID_HEVC);
+    } else if (sw_) {
+        encoder_ = avcodec_find_encoder_by_name(opts_.codec);
+    }
+    if (!encoder_ || (sw_ && encoder_->capabilities & AV_CODEC_CAP_HARDWARE)) {
+        fprintf(stderr, "Cannot find a software %s encoder\n", opts_.codec);
+        return -1;
+    }
+
+    queue_.reset(new VQueue<AVFrame*>(opts_.inFlight));
+
+    return 0;
+}
+
+int VEncoder::initHw()
+{
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(vatype_);
+
+    if (type != AV_HWDEVICE_TYPE_VAAPI) {
+        fprintf(stderr, "Device type %s is not supported for encoding.\n", vatype_);
+        return -1;
+    }
+
+    if (opts_.hwDevice) {
+        /* device shared with the decoders, their surfaces are encoded without a copy */
+        if (!(hwDeviceCtx_ = av_buffer_ref(opts_.hwDevice)))
+            return AVERROR(ENOMEM);
+    } else if (av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
+        fprintf(stderr, "Failed to create specified HW device.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int VEncoder::openHwFrames(const AVFrame* frame)
+{
+    AVHWFramesContext *frames = nullptr;
+    int ret = 0;
+
+    /* surfaces decoded on the same device are encoded from their own pool */
+    if (frame->hw_frames_ctx) {
+        frames = (AVHWFramesContext*)frame->hw_frames_ctx->data;
+        if (frames->device_ref->data != hwDeviceCtx_->data) {
+            fprintf(stderr, "Frame is on another device than the encoder\n");
+            return AVERROR(EINVAL);
+        }
+        encoderCtx_->hw_frames_ctx = av_buffer_ref(frame->hw_frames_ctx);
+        swFormat_ = frames->sw_format;
+        return encoderCtx_->hw_frames_ctx ? 0 : AVERROR(ENOMEM);
+    }
+
+    if (!(encoderCtx_->hw_frames_ctx = av_hwframe_ctx_alloc(hwDeviceCtx_)))
+        return AVERROR(ENOMEM);
+    frames = (AVHWFramesContext*)encoderCtx_->hw_frames_ctx->data;
+    frames->format = AV_PIX_FMT_VAAPI;
+    frames->sw_format = frame->format == AV_PIX_FMT_P010 ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
+    frames->width = frame->width;
+    frames->height = frame->height;
+    /* uploads happen on the encoder thread one at a time, the rest of the pool
+       covers the reference and reordered frames the encoder holds on to */
+    frames->initial_pool_size = 16 + opts_.maxBFrames;
+    if ((ret = av_hwframe_ctx_init(encoderCtx_->hw_frames_ctx)) < 0) {
+        fprintf(stderr, "Failed to create encoder surfaces\n");
+        return ret;
+    }
+    swFormat_ = frames->sw_format;
+
+    return 0;
+}
+
+int VEncoder::open(const AVFrame* frame)
+{
+    AVRational tb = { 1, opts_.fps > 0 ? opts_.fps : 30 };
+    int ret = 0;
+
+    if (avformat_alloc_output_context2(&outputCtx_, nullptr, nullptr, outfile_) < 0) {
+        fprintf(stderr, "Cannot create output for %s\n", outfile_);
+        return -1;
+    }
+    if (!(encoderCtx_ = avcodec_alloc_context3(encoder_)))
+        return AVERROR(ENOMEM);
+
+    encoderCtx_->width = frame->width;
+    encoderCtx_->height = frame->height;
+    encoderCtx_->time_base = tb;
+    encoderCtx_->framerate = av_inv_q(tb);
+    encoderCtx_->sample_aspect_ratio = frame->sample_aspect_ratio;
+    encoderCtx_->bit_rate = opts_.bitRate;
+    encoderCtx_->gop_size = opts_.gop;
+    encoderCtx_->max_b_frames = opts_.maxBFrames;
+    if (outputCtx_->oformat->flags & AVFMT_GLOBALHEADER)
+        encoderCtx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (!sw_) {
+        encoderCtx_->pix_fmt = AV_PIX_FMT_VAAPI;
+        if ((ret = openHwFrames(frame)) < 0)
+            return ret;
+    } else {
+        encoderCtx_->pix_fmt = encoder_->pix_fmts ? encoder_->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+        for (const enum AVPixelFormat *p = encoder_->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++) {
+            if (*p == frame->format)
+                encoderCtx_->pix_fmt = *p;
+        }
+        swFormat_ = encoderCtx_->pix_fmt;
+    }
+
+    if ((ret = avcodec_open2(encoderCtx_, encoder_, nullptr)) < 0) {
+        fprintf(stderr, "Failed to open encoder %s\n", encoder_->name);
+        return ret;
+    }
+
+    if (!(stream_ = avformat_new_stream(outputCtx_, nullptr)))
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_from_context(stream_->codecpar, encoderCtx_)) < 0)
+        return ret;
+    stream_->time_base = encoderCtx_->time_base;
+
+    if (!(outputCtx_->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&outputCtx_->pb, outfile_, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", outfile_);
+        return -1;
+    }
+    if ((ret = avformat_write_header(outputCtx_, nullptr)) < 0) {
+        fprintf(stderr, "Cannot write header to %s\n", outfile_);
+        return ret;
+    }
+
+    opened_ = true;
+    thread_ = std::thread(&VEncoder::encodeLoop, this);
+
+    return 0;
+}
+
+int VEncoder::encode(VFrame* f)
+{
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+    if ((ret = f->refFrame(frame)) == 0)
+        ret = encode(frame);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+int VEncoder::encode(const AVFrame* frame)
+{
+    AVFrame *clone = nullptr;
+    int ret = 0;
+
+    if (!queue_ || closed_)
+        return AVERROR(EINVAL);
+    if ((ret = error_.load()) < 0)
+        return ret;
+    if (!opened_ && (ret = open(frame)) < 0) {
+        error_ = ret;
+        return ret;
+    }
+    if (frame->width != encoderCtx_->width || frame->height != encoderCtx_->height) {
+        fprintf(stderr, "Frame size changed to %dx%d\n", frame->width, frame->height);
+        return AVERROR(EINVAL);
+    }
+
+    if (!(clone = av_frame_clone(frame)))
+        return AVERROR(ENOMEM);
+    /* output timestamps follow the submission order, the decoder's picture
+       types must not force key frames on the encoder */
+    clone->pts = frames_;
+    clone->pict_type = AV_PICTURE_TYPE_NONE;
+
+    /* blocks only while inFlight frames are already waiting */
+    if (!queue_->push(clone, stop_)) {
+        av_frame_free(&clone);
+        return AVERROR_EXIT;
+    }
+    frames_++;
+
+    return 0;
+}
+
+int VEncoder::close()
+{
+    AVFrame *eos = nullptr;
+    int ret = 0;
+
+    if (!opened_ || closed_)
+        return error_.load();
+    closed_ = true;
+
+    queue_->push(eos, stop_);
+    thread_.join();
+
+    if ((ret = av_write_trailer(outputCtx_)) < 0 && error_.load() == 0)
+        error_ = ret;
+
+    return error_.load();
+}
+
+void VEncoder::encodeLoop()
+{
+    AVFrame *frame = nullptr;
+    int ret = 0;
+
+    while (queue_->pop(frame, stop_)) {
+        if (!frame) {
+            /* end of stream, drain the frames the encoder still holds */
+            if (error_.load() == 0 && (ret = send(nullptr)) < 0)
+                error_ = ret;
+            break;
+        }
+
+        /* after an error the queue is still emptied so encode() never blocks */
+        if (error_.load() == 0) {
+            ret = prepare(frame);
+            if (ret == 0)
+                ret = send(frame);
+            if (ret < 0 && ret != AVERROR(EAGAIN))
+                error_ = ret;
+        }
+        av_frame_free(&frame);
+    }
+}
+
+int VEncoder::prepare(AVFrame* frame)
+{
+    AVFrame *tmp = nullptr;
+    int ret = 0;
+
+    if (frame->hw_frames_ctx) {
+        if (!sw_)
+            return 0;
+        /* surfaces from a hardware decoder, encoded in software */
+        if (!(tmp = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        if ((ret = av_hwframe_transfer_data(tmp, frame, 0)) < 0 ||
+            (ret = av_frame_copy_props(tmp, frame)) < 0) {
+            av_frame_free(&tmp);
+            return ret;
+        }
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, tmp);
+        av_frame_free(&tmp);
+    }
+
+    if (frame->format != swFormat_) {
+        if (!filter_)
+            filter_.reset(new VFilter(0, 0, nullptr, av_get_pix_fmt_name((AVPixelFormat)swFormat_)));
+        if ((ret = filter_->push(frame)) < 0 || (ret = filter_->pull(frame)) < 0)
+            return ret;
+    }
+
+    if (!sw_) {
+        if (!(tmp = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        if ((ret = av_hwframe_get_buffer(encoderCtx_->hw_frames_ctx, tmp, 0)) < 0 ||
+            (ret = av_hwframe_transfer_data(tmp, frame, 0)) < 0 ||
+            (ret = av_frame_copy_props(tmp, frame)) < 0) {
+            fprintf(stderr, "Failed to upload frame\n");
+            av_frame_free(&tmp);
+            return ret;
+        }
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, tmp);
+        av_frame_free(&tmp);
+    }
+
+    return 0;
+}
+
+int VEncoder::send(AVFrame* frame)
+{
+    AVPacket pkt;
+    int ret = 0;
+
+    if ((ret = avcodec_send_frame(encoderCtx_, frame)) < 0) {
+        fprintf(stderr, "Error during encoding\n");
+        return ret;
+    }
+
+    /* write out whatever the encoder has finished, it keeps the rest in flight */
+    while (true) {
+        av_init_packet(&pkt);
+        pkt.data = nullptr;
+        pkt.size = 0;
+        ret = avcodec_receive_packet(encoderCtx_, &pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
+
+        pkt.stream_index = stream_->index;
+        av_packet_rescale_ts(&pkt, encoderCtx_->time_base, stream_->time_base);
+        packets_++;
+        bytes_ += pkt.size;
+        /* the muxer takes ownership of the packet */
+        if ((ret = av_interleaved_write_frame(outputCtx_, &pkt)) < 0) {
+            fprintf(stderr, "Cannot write packet to %s\n", outfile_);
+            return ret;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "filter.hpp"
+#include "frame.hpp"
+#include "queue.hpp"
+
+struct AVBufferRef;
+struct AVCodec;
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVStream;
+
+struct VEncoderOptions
+{
+    // "h264" or "hevc": h264_vaapi/hevc_vaapi on a device, libx264/libx265
+    // otherwise
+    const char* codec = "h264";
+    int fps = 30;
+    int64_t bitRate = 4000000;
+    int gop = 60;
+    int maxBFrames = 0;
+    // frames accepted by encode() but not yet sent to the encoder; encode()
+    // only blocks once this many are waiting
+    int inFlight = 8;
+    // existing device context to encode on instead of creating one, a new
+    // reference is taken (see VAccelManager)
+    AVBufferRef *hwDevice = nullptr;
+    // encode on the CPU when the device or HW encoder is unavailable, type
+    // "sw" selects the software encoder directly
+    bool swFallback = true;
+};
+
+// Encodes frames to a file on its own thread. encode() only takes a reference to
+// the frame and queues it, the encoder thread uploads or converts it as needed,
+// sends it and drains every packet that is ready into the muxer, so the encoder
+// is kept busy while the caller produces the next frames. Host frames are
+// uploaded to device surfaces for the VAAPI encoders, device frames from a VAccel
+// on the same device are encoded as they are. The encoder is opened on the first
+// frame, with its size. encode() must be called from a single thread.
+class VEncoder
+{
+public:
+    VEncoder(const char* outf, const char* type="vaapi");
+    ~VEncoder();
+
+    int init(const VEncoderOptions& opts = VEncoderOptions());
+    int encode(VFrame* f);
+    // host or device frame, a new reference is taken
+    int encode(const AVFrame* frame);
+    // flush the encoder, write the trailer, returns the first error
+    int close();
+    bool isHardware() { return !sw_; }
+
+    int64_t getFrameCount() { return frames_; }
+    int64_t getPacketCount() { return packets_.load(); }
+    int64_t getBytes() { return bytes_.load(); }
+
+private:
+    int initHw();
+    int open(const AVFrame* frame);
+    int openHwFrames(const AVFrame* frame);
+    void encodeLoop();
+    int prepare(AVFrame* frame);
+    int send(AVFrame* frame);
+
+private:
+    const char* outfile_;
+    const char* vatype_;
+    VEncoderOptions opts_;
+    AVBufferRef *hwDeviceCtx_ = nullptr;
+    const AVCodec *encoder_ = nullptr;
+    AVCodecContext *encoderCtx_ = nullptr;
+    AVFormatContext *outputCtx_ = nullptr;
+    AVStream *stream_ = nullptr;
+    std::unique_ptr<VFilter> filter_;
+    // host format the encoder or the upload takes
+    int swFormat_ = -1;
+    bool sw_ = false;
+    bool opened_ = false;
+    bool closed_ = false;
+    int64_t frames_ = 0;
+
+    std::unique_ptr<VQueue<AVFrame*>> queue_;
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<int> error_{0};
+    std::atomic<int64_t> packets_{0};
+    std::atomic<int64_t> bytes_{0};
+};
@@ -0,0 +1,182 @@
+#include "filter.hpp"
+#include <stdio.h>
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+}
+
+VFilter::VFilter(int width, int height, const VRect* crop, const char* format) :
+    width_(width),
+    height_(height),
+    format_(format ? format : "")
+{
+    if (crop)
+        crop_ = *crop;
+}
+
+VFilter::~VFilter()
+{
+    avfilter_graph_free(&graph_);
+}
+
+std::string VFilter::describe(const AVFrame* frame)
+{
+    char buf[256];
+    std::string desc;
+    int cw = crop_.width > 0 ? crop_.width : frame->width;
+    int ch = crop_.height > 0 ? crop_.height : frame->height;
+    int w = width_ > 0 ? width_ : cw;
+    int h = height_ > 0 ? height_ : ch;
+
+    if (frame->hw_frames_ctx) {
+        /* the crop window comes in as the input region, see push() */
+        snprintf(buf, sizeof(buf), "scale_vaapi=w=%d:h=%d", w, h);
+        desc = buf;
+        if (!format_.empty())
+            desc += ":format=" + format_;
+        return desc;
+    }
+
+    if (crop_.width > 0) {
+        snprintf(buf, sizeof(buf), "crop=w=%d:h=%d:x=%d:y=%d", cw, ch, crop_.x, crop_.y);
+        desc = buf;
+    }
+    if (w != cw || h != ch) {
+        snprintf(buf, sizeof(buf), "scale=w=%d:h=%d", w, h);
+        desc += (desc.empty() ? "" : ",") + std::string(buf);
+    }
+    if (!format_.empty())
+        desc += (desc.empty() ? "" : ",") + std::string("format=pix_fmts=") + format_;
+
+    return desc.empty() ? "null" : desc;
+}
+
+int VFilter::open(const AVFrame* frame)
+{
+    char args[512];
+    int ret = 0;
+    std::string desc = describe(frame);
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    AVBufferSrcParameters *par = nullptr;
+
+    graph_ = avfilter_graph_alloc();
+    if (!graph_ || !outputs || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* timestamps only pass through, any time base will do */
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/90000:pixel_aspect=%d/%d",
+             frame->width, frame->height, frame->format,
+             frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den > 0 ?
+             frame->sample_aspect_ratio.den : 1);
+    if ((ret = avfilter_graph_create_filter(&src_, avfilter_get_by_name("buffer"), "in",
+                                            args, nullptr, graph_)) < 0)
+        goto end;
+
+    if (frame->hw_frames_ctx) {
+        if (!(par = av_buffersrc_parameters_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        par->hw_frames_ctx = frame->hw_frames_ctx;
+        ret = av_buffersrc_parameters_set(src_, par);
+        av_free(par);
+        if (ret < 0)
+            goto end;
+    }
+
+    if ((ret = avfilter_graph_create_filter(&sink_, avfilter_get_by_name("buffersink"), "out",
+                                            nullptr, nullptr, graph_)) < 0)
+        goto end;
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = src_;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = sink_;
+
+    if ((ret = avfilter_graph_parse_ptr(graph_, desc.c_str(), &inputs, &outputs, nullptr)) < 0)
+        goto end;
+    /* scale_vaapi allocates its output pool when the graph is configured */
+    for (unsigned i = 0; i < graph_->nb_filters && extraHwFrames_ > 0; i++)
+        graph_->filters[i]->extra_hw_frames = extraHwFrames_;
+    if ((ret = avfilter_graph_config(graph_, nullptr)) < 0)
+        goto end;
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "Cannot create filter graph \"%s\"\n", desc.c_str());
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+void VFilter::reset()
+{
+    avfilter_graph_free(&graph_);
+    src_ = nullptr;
+    sink_ = nullptr;
+    eof_ = false;
+}
+
+int VFilter::push(AVFrame* frame)
+{
+    int ret = 0;
+
+    if (!frame) {
+        if (eof_ || !src_)
+            return 0;
+        eof_ = true;
+        return av_buffersrc_add_frame_flags(src_, nullptr, 0);
+    }
+
+    if (frame->hw_frames_ctx && crop_.width > 0) {
+        /* scale_vaapi reads the surface region left inside the crop fields */
+        int right = frame->width - frame->crop_left - frame->crop_right - crop_.x - crop_.width;
+        int bottom = frame->height - frame->crop_top - frame->crop_bottom - crop_.y - crop_.height;
+        if (crop_.x < 0 || crop_.y < 0 || right < 0 || bottom < 0) {
+            fprintf(stderr, "Crop window does not fit the %dx%d surface\n", frame->width, frame->height);
+            av_frame_unref(frame);
+            return AVERROR(EINVAL);
+        }
+        frame->crop_left += crop_.x;
+        frame->crop_top += crop_.y;
+        frame->crop_right += right;
+        frame->crop_bottom += bottom;
+    }
+
+    if (!graph_ && (ret = open(frame)) < 0)
+        return ret;
+
+    /* the graph takes over the frame's references */
+    if ((ret = av_buffersrc_add_frame(src_, frame)) < 0)
+        fprintf(stderr, "Error while feeding the filter graph\n");
+
+    return ret;
+}
+
+int VFilter::pull(AVFrame* frame)
+{
+    int ret = 0;
+
+    if (!sink_)
+        return eof_ ? AVERROR_EOF : AVERROR(EAGAIN);
+    if ((ret = av_buffersink_get_frame(sink_, frame)) < 0)
+        return ret;
+
+    /* scale_vaapi copies the input region along with the other properties,
+       its output is the window already */
+    if (frame->hw_frames_ctx) {
+        frame->crop_left = 0;
+        frame->crop_top = 0;
+        frame->crop_right = 0;
+        frame->crop_bottom = 0;
+    }
+    return 0;
+}
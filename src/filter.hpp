@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+
+#include "frame.hpp"
+
+struct AVFrame;
+struct AVFilterGraph;
+struct AVFilterContext;
+
+// Crop/scale/format stage between the decoder and the host transfer. The graph is
+// built on the first frame: device surfaces go through scale_vaapi so only the
+// small output is downloaded, software frames through crop/scale/format. VAAPI
+// has no crop filter, the crop window is passed to scale_vaapi as the input
+// region through the frame's crop fields, so the device reads only the window.
+class VFilter
+{
+public:
+    // width/height 0 keep the (cropped) size, crop null keeps the full frame,
+    // format null keeps the decoder's pixel format
+    VFilter(int width, int height, const VRect* crop, const char* format);
+    ~VFilter();
+
+    // takes the references of frame, null signals the end of the stream
+    int push(AVFrame* frame);
+    // AVERROR(EAGAIN) until the graph has output, AVERROR_EOF once drained
+    int pull(AVFrame* frame);
+    // drop buffered frames and the end of stream, the graph is rebuilt on the
+    // next push() (after a seek)
+    void reset();
+    // surfaces the consumer holds on top of the graph's own pool, set before
+    // the first push()
+    void setExtraHwFrames(int n) { extraHwFrames_ = n; }
+
+private:
+    int open(const AVFrame* frame);
+    std::string describe(const AVFrame* frame);
+
+private:
+    int width_;
+    int height_;
+    VRect crop_ = {};
+    std::string format_;
+    AVFilterGraph *graph_ = nullptr;
+    AVFilterContext *src_ = nullptr;
+    AVFilterContext *sink_ = nullptr;
+    int extraHwFrames_ = 0;
+    bool eof_ = false;
+};
@@ -1,30 +1,272 @@
-
 #include "frame.hpp"
+#include <stdlib.h>
 #include <fstream>
 
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+// keeps the planes of an exported VFrame alive until the consumer is done
+struct VFrameExport
+{
+    DLManagedTensor managed;
+    int64_t shape[3];
+    int64_t strides[3];
+    AVFrame *frame;
+    AVBufferRef *buffer;
+};
+
+static void freeAligned(void*, uint8_t* data)
+{
+    free(data);
+}
+
+static void deleteExport(DLManagedTensor* self)
+{
+    VFrameExport *ctx = (VFrameExport*)self->manager_ctx;
+
+    av_frame_free(&ctx->frame);
+    av_buffer_unref(&ctx->buffer);
+    delete ctx;
+}
+
 VFrame::VFrame()
 {
 }
 
 VFrame::~VFrame()
 {
-    if (buffer_) {
-        delete [] buffer_;
-        buffer_ = nullptr;
-    }
+    av_buffer_unref(&bufferRef_);
+    buffer_ = nullptr;
+    av_frame_free(&frame_);
 }
 
-void VFrame::allocate(int32_t width, int32_t height) 
+int VFrame::allocate(int32_t width, int32_t height, int32_t format)
 {
+    AVPixelFormat fmt = (AVPixelFormat)format;
+    int linesize[4] = {};
+    uint8_t *data[4] = {};
+    int size = 0;
+
+    unref();
+    if (width <= 0 || height <= 0 || av_image_fill_linesizes(linesize, fmt, width) < 0)
+        return AVERROR(EINVAL);
+
+    /* pad every row so each one starts on an aligned address */
+    for (int i = 0; i < 4; i++)
+        linesize[i] = FFALIGN(linesize[i], align);
+    if ((size = av_image_fill_pointers(data, fmt, height, nullptr, linesize)) < 0)
+        return size;
+
+    /* an exported block stays with its consumer, never write over it */
+    if (bufferRef_ && (size > capacity_ || !av_buffer_is_writable(bufferRef_))) {
+        av_buffer_unref(&bufferRef_);
+        buffer_ = nullptr;
+        capacity_ = 0;
+    }
+    if (!bufferRef_) {
+        if (posix_memalign((void**)&buffer_, align, size)) {
+            buffer_ = nullptr;
+            return AVERROR(ENOMEM);
+        }
+        if (!(bufferRef_ = av_buffer_create(buffer_, size, freeAligned, nullptr, 0))) {
+            free(buffer_);
+            buffer_ = nullptr;
+            return AVERROR(ENOMEM);
+        }
+        capacity_ = size;
+    }
+
+    av_image_fill_pointers(data_, fmt, height, buffer_, linesize);
+    for (int i = 0; i < 4; i++)
+        linesize_[i] = linesize[i];
     width_ = width;
     height_ = height;
-    size_ = width * height * 3 / 2;
-    buffer_ = new uint8_t[size_];
+    format_ = format;
+    size_ = av_image_get_buffer_size(fmt, width, height, 1);
+
+    return 0;
+}
+
+int VFrame::copy(const AVFrame* frame, const VRect* rect)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    const uint8_t *src[4] = {};
+    int step[4] = {};
+    int x = 0, y = 0, w = frame->width, h = frame->height;
+    int ret = 0;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return AVERROR(EINVAL);
+
+    if (rect) {
+        x = FFMAX(rect->x, 0) & ~((1 << desc->log2_chroma_w) - 1);
+        y = FFMAX(rect->y, 0) & ~((1 << desc->log2_chroma_h) - 1);
+        w = FFMIN(rect->x + rect->width, frame->width) - x;
+        h = FFMIN(rect->y + rect->height, frame->height) - y;
+        if (w <= 0 || h <= 0)
+            return AVERROR(EINVAL);
+    }
+
+    if ((ret = allocate(w, h, frame->format)) < 0)
+        return ret;
+
+    /* only the rows and columns of the window are read from the source */
+    av_image_fill_max_pixsteps(step, nullptr, desc);
+    for (int p = 0; p < 4 && frame->data[p]; p++) {
+        int sx = (p == 1 || p == 2) ? desc->log2_chroma_w : 0;
+        int sy = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+        src[p] = frame->data[p] + (y >> sy) * frame->linesize[p] + (x >> sx) * step[p];
+    }
+    av_image_copy(data_, linesize_, src, frame->linesize, (AVPixelFormat)frame->format, w, h);
+
+    return 0;
+}
+
+int VFrame::getPlaneCount()
+{
+    return (format_ < 0) ? 0 : av_pix_fmt_count_planes((AVPixelFormat)format_);
+}
+
+int32_t VFrame::getRowBytes(int plane)
+{
+    int bytes = av_image_get_linesize((AVPixelFormat)format_, width_, plane);
+    return (bytes < 0) ? 0 : bytes;
+}
+
+int32_t VFrame::getPlaneHeight(int plane)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)format_);
+
+    if (!desc)
+        return 0;
+    /* plane 1 is the interleaved chroma of semi-planar formats */
+    return (plane == 1 || plane == 2) ? AV_CEIL_RSHIFT(height_, desc->log2_chroma_h) : height_;
+}
+
+int VFrame::attach(AVFrame* frame)
+{
+    unref();
+    if (!frame_ && !(frame_ = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    // take over the buffer references of the decoded frame, no pixel copy
+    av_frame_move_ref(frame_, frame);
+    for (int i = 0; i < 4; i++) {
+        data_[i] = frame_->data[i];
+        linesize_[i] = frame_->linesize[i];
+    }
+    width_ = frame_->width;
+    height_ = frame_->height;
+    format_ = frame_->format;
+    size_ = av_image_get_buffer_size((AVPixelFormat)format_, width_, height_, 1);
+    ref_ = true;
+
+    return 0;
+}
+
+void VFrame::unref()
+{
+    if (!ref_)
+        return;
+
+    av_frame_unref(frame_);
+    for (int i = 0; i < 4; i++) {
+        data_[i] = nullptr;
+        linesize_[i] = 0;
+    }
+    size_ = 0;
+    width_ = 0;
+    height_ = 0;
+    format_ = -1;
+    ref_ = false;
+}
+
+DLManagedTensor* VFrame::toDLPack(int plane)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)format_);
+    VFrameExport *ctx = nullptr;
+    int comps = 0, step = 0, bytes = 1, offset = -1;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        plane < 0 || plane >= getPlaneCount() || !data_[plane])
+        return nullptr;
+
+    for (int c = 0; c < desc->nb_components; c++) {
+        if (desc->comp[c].plane != plane)
+            continue;
+        comps++;
+        step = desc->comp[c].step;
+        if (offset < 0 || desc->comp[c].offset < offset)
+            offset = desc->comp[c].offset;
+        /* P010 and friends keep 10..16 bit samples in 16-bit words */
+        bytes = (desc->comp[c].depth + desc->comp[c].shift > 8) ? 2 : 1;
+    }
+    if (!comps || linesize_[plane] % bytes)
+        return nullptr;
+
+    ctx = new VFrameExport();
+    if (ref_)
+        ctx->frame = av_frame_clone(frame_);
+    else
+        ctx->buffer = av_buffer_ref(bufferRef_);
+    if (!ctx->frame && !ctx->buffer) {
+        delete ctx;
+        return nullptr;
+    }
+
+    DLTensor& t = ctx->managed.dl_tensor;
+    t.data = data_[plane] + offset;
+    t.device.device_type = kDLCPU;
+    t.device.device_id = 0;
+    t.ndim = (comps > 1) ? 3 : 2;
+    t.dtype.code = kDLUInt;
+    t.dtype.bits = bytes * 8;
+    t.dtype.lanes = 1;
+    t.shape = ctx->shape;
+    t.strides = ctx->strides;
+    t.byte_offset = 0;
+
+    /* strides are in elements, rows keep the frame's padding */
+    ctx->shape[0] = getPlaneHeight(plane);
+    ctx->shape[1] = (plane == 1 || plane == 2) ? AV_CEIL_RSHIFT(width_, desc->log2_chroma_w) : width_;
+    ctx->shape[2] = comps;
+    ctx->strides[0] = linesize_[plane] / bytes;
+    ctx->strides[1] = step / bytes;
+    ctx->strides[2] = 1;
+
+    ctx->managed.manager_ctx = ctx;
+    ctx->managed.deleter = deleteExport;
+    return &ctx->managed;
+}
+
+int VFrame::refFrame(AVFrame* dst)
+{
+    if (ref_)
+        return av_frame_ref(dst, frame_);
+    if (!bufferRef_ || size_ <= 0)
+        return AVERROR(EINVAL);
+
+    av_frame_unref(dst);
+    if (!(dst->buf[0] = av_buffer_ref(bufferRef_)))
+        return AVERROR(ENOMEM);
+    for (int i = 0; i < 4; i++) {
+        dst->data[i] = data_[i];
+        dst->linesize[i] = linesize_[i];
+    }
+    dst->width = width_;
+    dst->height = height_;
+    dst->format = format_;
+
+    return 0;
 }
 
 void VFrame::saveFile()
 {
-    if (buffer_ && size_ > 0){
+    if (size_ > 0) {
         std::ofstream f;
         if (firstWrite_) {
             f.open("out.yuv", std::ios::binary);
@@ -33,9 +275,14 @@ void VFrame::saveFile()
             f.open("out.yuv", std::ios::binary | std::ios::app);
         }
         if (f.is_open()) {
-            f.write((const char*)buffer_, size_);
+            for (int p = 0; p < getPlaneCount(); p++) {
+                int h = getPlaneHeight(p);
+                int bytes = getRowBytes(p);
+                for (int y = 0; y < h; y++)
+                    f.write((const char*)data_[p] + y * linesize_[p], bytes);
+            }
             f.flush();
             f.close();
         }
     }
-}
\ No newline at end of file
+}
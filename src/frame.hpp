@@ -2,24 +2,81 @@
 
 #include <stdint.h>
 
+#include "dlpack.hpp"
+
+struct AVBufferRef;
+struct AVFrame;
+
+struct VRect
+{
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+// Decoded picture in its native pixel format (an AVPixelFormat value: NV12,
+// I420, P010, ...). The planes are either references to the decoder's buffers
+// (attach()) or owned by the frame (allocate()): one block aligned to 64 bytes
+// with every row padded to a multiple of 64, so SIMD consumers can use aligned
+// loads on any row of any plane. getData()/getLinesize() are valid in both cases.
+// Both kinds of storage are refcounted, so a plane can be handed to another
+// framework with toDLPack() without copying it.
 class VFrame
 {
 public:
+    static const int32_t align = 64;
+
     VFrame();
     ~VFrame();
 
+    // owned block (planes and row padding), null until allocate()
     uint8_t* getBuf() { return buffer_; }
+    // bytes of pixel data without row padding
     int32_t getSize() { return size_; }
     int32_t getWidth() { return width_; }
     int32_t getHeight() { return height_; }
+    int32_t getFormat() { return format_; }
+
+    bool isRef() { return ref_; }
+    int getPlaneCount();
+    uint8_t* getData(int plane) { return data_[plane]; }
+    int32_t getLinesize(int plane) { return linesize_[plane]; }
+    // bytes of pixels in one row of plane, without padding
+    int32_t getRowBytes(int plane);
+    int32_t getPlaneHeight(int plane);
 
-    void allocate(int32_t width, int32_t height);
+    // format defaults to AV_PIX_FMT_YUV420P, the block is kept and reused
+    // while it is large enough
+    int allocate(int32_t width, int32_t height, int32_t format=0);
+    // copy the planes of a host frame, or only the window rect of them (x/y
+    // snapped down to the chroma grid, clamped to the frame), keeping its format
+    int copy(const AVFrame* frame, const VRect* rect=nullptr);
+    int attach(AVFrame* frame);
+    void unref();
+    // DLPack view of one plane, [h, w] or [h, w, components] for interleaved
+    // planes (NV12 chroma, packed RGB), uint8 or uint16 (P010) elements. It
+    // holds its own reference to the buffer, so the frame can be reused right
+    // away: the next allocate() then starts a new block instead of writing
+    // over the exported one. Null for hardware formats.
+    DLManagedTensor* toDLPack(int plane);
+    // new references to the planes in dst (format, size and pointers set),
+    // no pixel copy; like toDLPack() the frame stays free to be reused
+    int refFrame(AVFrame* dst);
+    // reopens out.yuv for every frame, VWriter is the faster sink
     void saveFile();
 
 private:
     uint8_t *buffer_ = nullptr;
+    AVBufferRef *bufferRef_ = nullptr;
+    int32_t capacity_ = 0;
+    AVFrame *frame_ = nullptr;
+    uint8_t *data_[4] = {};
+    int32_t linesize_[4] = {};
+    bool ref_ = false;
     bool firstWrite_ = true;
     int32_t size_ = 0;
     int32_t width_ = 0;
     int32_t height_ = 0;
-};
\ No newline at end of file
+    int32_t format_ = -1;
+};
@@ -0,0 +1,218 @@
+#include "index.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// sidecar layout: header, keyCount VIndexKey entries, frameCount int64 pts
+struct VIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    int64_t srcSize;
+    int64_t srcMtime;
+    int64_t keyCount;
+    int64_t frameCount;
+    uint32_t hasPts;
+    uint32_t reserved;
+};
+
+static const char indexMagic[4] = { 'V', 'I', 'D', 'X' };
+static const uint32_t indexVersion = 1;
+
+VIndex::VIndex()
+{
+}
+
+VIndex::~VIndex()
+{
+    reset();
+}
+
+void VIndex::reset()
+{
+    if (map_) {
+        munmap(map_, mapSize_);
+        map_ = nullptr;
+        mapSize_ = 0;
+    }
+    keyVec_.clear();
+    ptsVec_.clear();
+    keys_ = nullptr;
+    pts_ = nullptr;
+    keyCount_ = 0;
+    frameCount_ = 0;
+    hasPts_ = false;
+}
+
+int VIndex::rewind(AVFormatContext* ctx, int stream)
+{
+    AVStream *st = ctx->streams[stream];
+    int64_t start = (st->start_time != AV_NOPTS_VALUE) ? st->start_time : 0;
+
+    /* timestamps first, raw streams without them only seek by bytes */
+    if (av_seek_frame(ctx, stream, start, AVSEEK_FLAG_BACKWARD) >= 0)
+        return 0;
+    return av_seek_frame(ctx, stream, 0, AVSEEK_FLAG_BYTE);
+}
+
+int VIndex::build(AVFormatContext* ctx, int stream)
+{
+    AVPacket packet = {};
+    std::vector<int64_t> keyPts;
+    int64_t decodeIdx = 0;
+
+    reset();
+    hasPts_ = true;
+
+    /* the scan must see every packet, whatever was read before */
+    if (rewind(ctx, stream) < 0) {
+        fprintf(stderr, "Cannot rewind the input to build the index\n");
+        return -1;
+    }
+
+    while (av_read_frame(ctx, &packet) >= 0) {
+        if (packet.stream_index == stream) {
+            int64_t pts = (packet.pts != AV_NOPTS_VALUE) ? packet.pts : packet.dts;
+            if (pts == AV_NOPTS_VALUE)
+                hasPts_ = false;
+            if (!hasPts_)
+                pts = decodeIdx;
+
+            ptsVec_.push_back(pts);
+            if (packet.flags & AV_PKT_FLAG_KEY) {
+                VIndexKey key = { pts, packet.pos, decodeIdx };
+                keyVec_.push_back(key);
+            }
+            decodeIdx++;
+        }
+        av_packet_unref(&packet);
+    }
+
+    if (!hasPts_) {
+        /* without timestamps decode order is the only order there is */
+        for (size_t i = 0; i < ptsVec_.size(); i++)
+            ptsVec_[i] = i;
+        for (size_t k = 0; k < keyVec_.size(); k++)
+            keyVec_[k].pts = keyVec_[k].frame;
+    } else {
+        std::sort(ptsVec_.begin(), ptsVec_.end());
+        for (size_t k = 0; k < keyVec_.size(); k++) {
+            keyVec_[k].frame = std::lower_bound(ptsVec_.begin(), ptsVec_.end(), keyVec_[k].pts) -
+                               ptsVec_.begin();
+        }
+        std::sort(keyVec_.begin(), keyVec_.end(),
+                  [](const VIndexKey& a, const VIndexKey& b) { return a.frame < b.frame; });
+    }
+
+    keys_ = keyVec_.data();
+    pts_ = ptsVec_.data();
+    keyCount_ = keyVec_.size();
+    frameCount_ = ptsVec_.size();
+
+    if (!keyCount_ || !frameCount_) {
+        fprintf(stderr, "No keyframes found while building the index\n");
+        return -1;
+    }
+    return 0;
+}
+
+int VIndex::load(const char* path, int64_t srcSize, int64_t srcMtime)
+{
+    struct stat st;
+    const VIndexHeader *hdr = nullptr;
+    int fd = -1;
+
+    reset();
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(VIndexHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    mapSize_ = st.st_size;
+    map_ = mmap(nullptr, mapSize_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        mapSize_ = 0;
+        return -1;
+    }
+
+    /* the counts are bounded by the file before they are multiplied, so a
+       damaged header cannot wrap the size check around */
+    hdr = (const VIndexHeader*)map_;
+    if (memcmp(hdr->magic, indexMagic, 4) || hdr->version != indexVersion ||
+        hdr->srcSize != srcSize || hdr->srcMtime != srcMtime ||
+        hdr->keyCount < 0 || (uint64_t)hdr->keyCount > mapSize_ / sizeof(VIndexKey) ||
+        hdr->frameCount < 0 || (uint64_t)hdr->frameCount > mapSize_ / sizeof(int64_t) ||
+        mapSize_ != sizeof(VIndexHeader) + hdr->keyCount * sizeof(VIndexKey) +
+                    hdr->frameCount * sizeof(int64_t)) {
+        reset();
+        return -1;
+    }
+
+    keyCount_ = hdr->keyCount;
+    frameCount_ = hdr->frameCount;
+    hasPts_ = hdr->hasPts != 0;
+    keys_ = (const VIndexKey*)(hdr + 1);
+    pts_ = (const int64_t*)(keys_ + keyCount_);
+
+    return 0;
+}
+
+int VIndex::save(const char* path, int64_t srcSize, int64_t srcMtime)
+{
+    VIndexHeader hdr = {};
+    char tmp[1024];
+    FILE *fp = nullptr;
+    bool ok = true;
+
+    if (!isValid())
+        return -1;
+
+    memcpy(hdr.magic, indexMagic, 4);
+    hdr.version = indexVersion;
+    hdr.srcSize = srcSize;
+    hdr.srcMtime = srcMtime;
+    hdr.keyCount = keyCount_;
+    hdr.frameCount = frameCount_;
+    hdr.hasPts = hasPts_;
+
+    /* write aside and rename so concurrent readers never map a partial file */
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (!(fp = fopen(tmp, "wb"))) {
+        fprintf(stderr, "Cannot write index file %s\n", tmp);
+        return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+         fwrite(keys_, sizeof(VIndexKey), keyCount_, fp) == (size_t)keyCount_ &&
+         fwrite(pts_, sizeof(int64_t), frameCount_, fp) == (size_t)frameCount_;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "Cannot write index file %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+const VIndexKey* VIndex::findKey(int64_t frame)
+{
+    if (!keyCount_)
+        return nullptr;
+
+    const VIndexKey *key = std::upper_bound(keys_, keys_ + keyCount_, frame,
+        [](int64_t f, const VIndexKey& k) { return f < k.frame; });
+
+    return (key == keys_) ? keys_ : key - 1;
+}
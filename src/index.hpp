@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+struct AVFormatContext;
+
+struct VIndexKey
+{
+    int64_t pts;    // presentation timestamp, or decode order number without pts
+    int64_t pos;    // byte offset of the packet in the container
+    int64_t frame;  // presentation order number of the keyframe
+};
+
+// Keyframe and per-frame timestamp table of one video stream. It is built by
+// scanning packets (no decoding) and kept in a sidecar file next to the input,
+// which is memory-mapped instead of rebuilt on the next open.
+class VIndex
+{
+public:
+    VIndex();
+    ~VIndex();
+
+    int build(AVFormatContext* ctx, int stream);
+    // both fail when the sidecar is missing or stale against srcSize/srcMtime
+    int load(const char* path, int64_t srcSize, int64_t srcMtime);
+    int save(const char* path, int64_t srcSize, int64_t srcMtime);
+
+    bool isValid() { return frameCount_ > 0; }
+    bool hasPts() { return hasPts_; }
+    int64_t getFrameCount() { return frameCount_; }
+    int64_t getPts(int64_t frame) { return pts_[frame]; }
+    // last keyframe at or before frame (in presentation order), the first
+    // keyframe for leading frames that precede it
+    const VIndexKey* findKey(int64_t frame);
+
+private:
+    void reset();
+    static int rewind(AVFormatContext* ctx, int stream);
+
+private:
+    std::vector<VIndexKey> keyVec_;
+    std::vector<int64_t> ptsVec_;
+    const VIndexKey *keys_ = nullptr;
+    const int64_t *pts_ = nullptr;
+    int64_t keyCount_ = 0;
+    int64_t frameCount_ = 0;
+    bool hasPts_ = false;
+    void *map_ = nullptr;
+    size_t mapSize_ = 0;
+};
@@ -0,0 +1,171 @@
+#include "input.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+VInput::VInput(const uint8_t* data, size_t size, int bufSize) :
+    name_("memory"),
+    bufSize_(bufSize),
+    data_(data),
+    size_(size)
+{
+}
+
+VInput::VInput(const char* path, int64_t offset, int64_t size, int bufSize) :
+    name_(path),
+    bufSize_(bufSize),
+    size_(size),
+    path_(path),
+    mapOffset_(offset)
+{
+}
+
+VInput::VInput(const ReadFn& read, const SeekFn& seek, int bufSize) :
+    name_("callback"),
+    bufSize_(bufSize),
+    read_(read),
+    seek_(seek)
+{
+}
+
+VInput::~VInput()
+{
+    if (ioCtx_) {
+        av_freep(&ioCtx_->buffer);
+        avio_context_free(&ioCtx_);
+    }
+    if (map_)
+        munmap(map_, mapSize_);
+}
+
+int VInput::open()
+{
+    uint8_t *buffer = nullptr;
+
+    if (!path_.empty() && !map_) {
+        struct stat st;
+        int64_t align = mapOffset_ % sysconf(_SC_PAGE_SIZE);
+        int fd = ::open(path_.c_str(), O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) < 0 || mapOffset_ < 0 || mapOffset_ >= st.st_size) {
+            fprintf(stderr, "Cannot open input region of %s\n", path_.c_str());
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        if (size_ <= 0 || mapOffset_ + size_ > st.st_size)
+            size_ = st.st_size - mapOffset_;
+
+        /* mmap wants a page aligned offset, skip the head in data_ */
+        mapSize_ = size_ + align;
+        map_ = mmap(nullptr, mapSize_, PROT_READ, MAP_PRIVATE, fd, mapOffset_ - align);
+        close(fd);
+        if (map_ == MAP_FAILED) {
+            fprintf(stderr, "Cannot map input region of %s\n", path_.c_str());
+            map_ = nullptr;
+            return -1;
+        }
+        madvise(map_, mapSize_, MADV_SEQUENTIAL);
+        data_ = (const uint8_t*)map_ + align;
+    }
+
+    if (!(buffer = (uint8_t*)av_malloc(bufSize_)))
+        return AVERROR(ENOMEM);
+
+    ioCtx_ = avio_alloc_context(buffer, bufSize_, 0, this, readPacket, nullptr,
+                                (read_ && !seek_) ? nullptr : seek);
+    if (!ioCtx_) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+const std::string& VInput::getKey()
+{
+    char key[64];
+
+    /* the region is only final once open() clamped it to the file */
+    if (key_.empty() && !path_.empty() && map_) {
+        snprintf(key, sizeof(key), "@%lld+%lld", (long long)mapOffset_, (long long)size_);
+        key_ = path_ + key;
+    }
+    return key_;
+}
+
+int64_t VInput::getSize()
+{
+    if (data_)
+        return size_;
+    if (seek_)
+        return seek_(0, AVSEEK_SIZE);
+    return -1;
+}
+
+int VInput::readPacket(void* opaque, uint8_t* buf, int size)
+{
+    VInput *in = (VInput*)opaque;
+
+    if (in->read_)
+        return in->read_(buf, size);
+    return in->readMemory(buf, size);
+}
+
+int64_t VInput::seek(void* opaque, int64_t offset, int whence)
+{
+    VInput *in = (VInput*)opaque;
+
+    if (in->seek_)
+        return in->seek_(offset, whence);
+    return in->seekMemory(offset, whence);
+}
+
+int VInput::readMemory(uint8_t* buf, int size)
+{
+    int64_t left = size_ - pos_;
+
+    if (left <= 0)
+        return AVERROR_EOF;
+    if (size > left)
+        size = (int)left;
+
+    memcpy(buf, data_ + pos_, size);
+    pos_ += size;
+    return size;
+}
+
+int64_t VInput::seekMemory(int64_t offset, int whence)
+{
+    int64_t pos = 0;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return size_;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = pos_ + offset;
+        break;
+    case SEEK_END:
+        pos = size_ + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0 || pos > size_)
+        return AVERROR(EINVAL);
+    pos_ = pos;
+    return pos_;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+struct AVIOContext;
+
+// Custom byte source for VAccel, exposed to libavformat as an AVIOContext so
+// clips can be decoded straight out of memory, a mapped region of a larger file
+// (e.g. a packed dataset shard) or any reader, without going through a file.
+class VInput
+{
+public:
+    // same contract as AVIOContext read_packet/seek: read returns the number of
+    // bytes or AVERROR_EOF, seek also answers AVSEEK_SIZE (or returns < 0)
+    typedef std::function<int(uint8_t* buf, int size)> ReadFn;
+    typedef std::function<int64_t(int64_t offset, int whence)> SeekFn;
+
+    static const int defaultBufSize = 64 * 1024;
+
+    // caller keeps data alive for the lifetime of the VInput
+    VInput(const uint8_t* data, size_t size, int bufSize=defaultBufSize);
+    // maps [offset, offset + size) of path read-only, size 0 means up to the end
+    VInput(const char* path, int64_t offset, int64_t size, int bufSize=defaultBufSize);
+    VInput(const ReadFn& read, const SeekFn& seek, int bufSize=defaultBufSize);
+    ~VInput();
+
+    int open();
+    AVIOContext* getContext() { return ioCtx_; }
+    const char* getName() { return name_.c_str(); }
+    // identity of the bytes for caches shared across inputs (VFrameCache):
+    // "<path>@<offset>+<size>" for a mapped region, empty for memory and
+    // callbacks unless the caller names them, as buffers and readers get reused
+    const std::string& getKey();
+    void setKey(const std::string& key) { key_ = key; }
+    // total size in bytes, -1 when unknown
+    int64_t getSize();
+
+private:
+    static int readPacket(void* opaque, uint8_t* buf, int size);
+    static int64_t seek(void* opaque, int64_t offset, int whence);
+    int readMemory(uint8_t* buf, int size);
+    int64_t seekMemory(int64_t offset, int whence);
+
+private:
+    std::string name_;
+    std::string key_;
+    int bufSize_;
+    AVIOContext *ioCtx_ = nullptr;
+
+    const uint8_t *data_ = nullptr;
+    int64_t size_ = 0;
+    int64_t pos_ = 0;
+
+    std::string path_;
+    int64_t mapOffset_ = 0;
+    void *map_ = nullptr;
+    size_t mapSize_ = 0;
+
+    ReadFn read_;
+    SeekFn seek_;
+};
@@ -0,0 +1,262 @@
+#include "loader.hpp"
+#include <string.h>
+#include <functional>
+#include <random>
+
+VLoader::VLoader(const std::vector<std::string>& files, const char* type) :
+    files_(files),
+    vatype_(type)
+{
+}
+
+VLoader::~VLoader()
+{
+    stopEpoch();
+    pool_.reset();
+    av_buffer_unref(&hwDeviceCtx_);
+}
+
+int VLoader::init(const VLoaderOptions& opts)
+{
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+
+    opts_ = opts;
+    if (opts_.decoders < 1)
+        opts_.decoders = 1;
+    if (opts_.prefetch < 1)
+        opts_.prefetch = 1;
+    /* frames are referenced by the consumer on the host */
+    opts_.accel.onDevice = false;
+    opts_.accel.pipelined = false;
+    /* one shard path would be shared by every file, and next() hands out
+       frames, never the tensors a shard holds */
+    opts_.accel.shard = nullptr;
+
+    /* one device for all decoders, as in VAccelManager */
+    if (strcmp(vatype_, "sw")) {
+        type = av_hwdevice_find_type_by_name(vatype_);
+        if (type == AV_HWDEVICE_TYPE_NONE ||
+            av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
+            fprintf(stderr, "Failed to create specified HW device.\n");
+            if (!opts_.accel.swFallback)
+                return -1;
+            vatype_ = "sw";
+        }
+    }
+    opts_.accel.hwDevice = hwDeviceCtx_;
+    if (!hwDeviceCtx_ && opts_.accel.threads == 0) {
+        /* the pool already decodes files in parallel, don't oversubscribe the cores */
+        opts_.accel.threads = 1;
+    }
+
+    pool_.reset(new VThreadPool(opts_.workers));
+    return 0;
+}
+
+std::vector<int> VLoader::getOrder(int epoch)
+{
+    std::vector<int> order(files_.size());
+
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (int)i;
+    if (!opts_.shuffle)
+        return order;
+
+    /* Fisher-Yates on mt19937_64, whose output is fixed by the standard,
+       unlike std::shuffle and the distributions */
+    std::mt19937_64 rng(opts_.seed ^ ((uint64_t)(epoch + 1) * 0x9E3779B97F4A7C15ULL));
+    for (size_t i = order.size(); i > 1; i--) {
+        size_t j = rng() % i;
+        std::swap(order[i - 1], order[j]);
+    }
+
+    return order;
+}
+
+int VLoader::startEpoch(int epoch)
+{
+    std::vector<int> order;
+
+    if (!pool_) {
+        fprintf(stderr, "VLoader is not initialized\n");
+        return -1;
+    }
+
+    stopEpoch();
+    order = getOrder(epoch);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 0; i < opts_.decoders; i++)
+        slots_.push_back(std::unique_ptr<Slot>(new Slot));
+    /* dealt round-robin, so each decoder's files are fixed by the order alone */
+    for (size_t i = 0; i < order.size(); i++)
+        slots_[i % slots_.size()]->files.push_back(order[i]);
+    turn_ = 0;
+    stopping_ = false;
+    schedule();
+
+    return 0;
+}
+
+void VLoader::stopEpoch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    /* running tasks finish their frame and see stopping_ */
+    if (pool_)
+        pool_->wait();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < slots_.size(); i++) {
+        for (size_t j = 0; j < slots_[i]->items.size(); j++)
+            av_frame_free(&slots_[i]->items[j].frame);
+    }
+    slots_.clear();
+    queuedBytes_ = 0;
+}
+
+bool VLoader::canDecode(const Slot* s)
+{
+    if (stopping_ || s->done || (int)s->items.size() >= opts_.prefetch)
+        return false;
+    /* over budget only a decoder the consumer may be waiting on goes on */
+    return queuedBytes_ < opts_.memoryBudget || s->items.empty();
+}
+
+void VLoader::schedule()
+{
+    for (size_t i = 0; i < slots_.size(); i++) {
+        Slot *s = slots_[i].get();
+        if (s->scheduled || !canDecode(s))
+            continue;
+        s->scheduled = true;
+        pool_->submit(std::bind(&VLoader::decodeTask, this, (int)i));
+    }
+}
+
+void VLoader::decodeTask(int id)
+{
+    Slot *s = nullptr;
+    Item item = {};
+    int ret = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        s = slots_[id].get();
+    }
+
+    while (1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!canDecode(s)) {
+                s->scheduled = false;
+                return;
+            }
+        }
+
+        /* only this task touches the slot's decoder while scheduled is set */
+        ret = decodeOne(s, &item);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (ret == 0) {
+                s->items.push_back(item);
+                queuedBytes_ += item.bytes;
+            } else {
+                s->done = true;
+            }
+        }
+        cv_.notify_all();
+    }
+}
+
+int VLoader::decodeOne(Slot* s, Item* item)
+{
+    AVFrame *frame = nullptr;
+    int ret = 0;
+
+    while (1) {
+        if (!s->accel) {
+            if (s->nextFile >= s->files.size())
+                return AVERROR_EOF;
+            s->file = s->files[s->nextFile++];
+            s->frame = 0;
+            s->accel.reset(new VAccel(files_[s->file].c_str(), "out.yuv", vatype_));
+            if (s->accel->init(opts_.accel) < 0) {
+                fprintf(stderr, "Cannot open %s, skipping it\n", files_[s->file].c_str());
+                s->accel.reset();
+                skipped_++;
+                continue;
+            }
+        }
+
+        if (opts_.framesPerFile > 0 && s->frame >= opts_.framesPerFile) {
+            s->accel.reset();
+            continue;
+        }
+
+        if (!(frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        if ((ret = s->accel->getSurface(frame)) < 0) {
+            if (ret != AVERROR_EOF)
+                fprintf(stderr, "Decoding %s failed, skipping the rest\n", files_[s->file].c_str());
+            av_frame_free(&frame);
+            s->accel.reset();
+            continue;
+        }
+
+        item->frame = frame;
+        item->bytes = av_image_get_buffer_size((AVPixelFormat)frame->format,
+                                               frame->width, frame->height, 1);
+        item->info.file = s->file;
+        item->info.frame = s->frame++;
+        return 0;
+    }
+}
+
+int VLoader::next(VFrame* f, VSampleInfo* info)
+{
+    Item item = {};
+    int ret = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (slots_.empty())
+            return AVERROR(EINVAL);
+
+        /* always the turn's decoder, even when another one is ahead */
+        for (size_t finished = 0; finished < slots_.size(); ) {
+            Slot *s = slots_[turn_].get();
+            schedule();
+            cv_.wait(lock, [s] { return !s->items.empty() || s->done; });
+            turn_ = (turn_ + 1) % slots_.size();
+            if (s->items.empty()) {
+                finished++;
+                continue;
+            }
+
+            item = s->items.front();
+            s->items.pop_front();
+            queuedBytes_ -= item.bytes;
+            break;
+        }
+        if (!item.frame)
+            return AVERROR_EOF;
+        schedule();
+    }
+
+    if (info)
+        *info = item.info;
+    ret = f->attach(item.frame);
+    av_frame_free(&item.frame);
+
+    return ret;
+}
+
+size_t VLoader::getQueuedBytes()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queuedBytes_;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "accel.hpp"
+#include "threadpool.hpp"
+
+struct VLoaderOptions
+{
+    // files decoded at once, each on its own VAccel
+    int decoders = 4;
+    // pool threads shared by the decoders, 0 picks one per core
+    int workers = 0;
+    // with the epoch number, fixes the file order and so the whole epoch
+    uint64_t seed = 0;
+    bool shuffle = true;
+    // bytes of decoded frames held ahead of the consumer by all decoders;
+    // a decoder with nothing queued may always go one frame over
+    size_t memoryBudget = 256 << 20;
+    // frames queued per decoder at most
+    int prefetch = 16;
+    // frames taken from the start of each file, 0 for all of them
+    int framesPerFile = 0;
+    // options of every decoder; hwDevice is set by the loader, shard is
+    // ignored
+    VAccelOptions accel;
+};
+
+struct VSampleInfo
+{
+    // index into the file list, and frame number within that file
+    int32_t file;
+    int64_t frame;
+};
+
+// Frames of many files, decoded ahead on a thread pool for a training loop.
+// Each epoch shuffles the file list with (seed, epoch) and deals it round-robin
+// to the decoders, then next() takes one frame from each decoder in turn, so the
+// sequence of frames only depends on the seed, the epoch and the options, never
+// on thread timing. Decoders stop once the frames queued for all of them reach
+// the memory budget and resume as next() hands frames out. A file that cannot
+// be opened is skipped. next() must be called from a single thread.
+class VLoader
+{
+public:
+    explicit VLoader(const std::vector<std::string>& files, const char* type="vaapi");
+    ~VLoader();
+
+    int init(const VLoaderOptions& opts = VLoaderOptions());
+    // drop what is queued and start decoding epoch
+    int startEpoch(int epoch);
+    // the next frame (referenced, no copy), AVERROR_EOF at the end of the epoch
+    int next(VFrame* f, VSampleInfo* info=nullptr);
+
+    // file order of epoch, as next() walks through it per decoder
+    std::vector<int> getOrder(int epoch);
+    size_t getQueuedBytes();
+    int64_t getSkippedFiles() { return skipped_.load(); }
+
+private:
+    struct Item
+    {
+        AVFrame *frame;
+        size_t bytes;
+        VSampleInfo info;
+    };
+
+    struct Slot
+    {
+        // files of this decoder for the epoch, in order
+        std::vector<int> files;
+        size_t nextFile = 0;
+        std::unique_ptr<VAccel> accel;
+        int file = -1;
+        int64_t frame = 0;
+        std::deque<Item> items;
+        bool scheduled = false;
+        bool done = false;
+    };
+
+    void stopEpoch();
+    void schedule();
+    void decodeTask(int id);
+    int decodeOne(Slot* s, Item* item);
+    bool canDecode(const Slot* s);
+
+private:
+    std::vector<std::string> files_;
+    const char* vatype_;
+    VLoaderOptions opts_;
+    AVBufferRef *hwDeviceCtx_ = nullptr;
+    std::unique_ptr<VThreadPool> pool_;
+    std::vector<std::unique_ptr<Slot>> slots_;
+    int turn_ = 0;
+    size_t queuedBytes_ = 0;
+    std::atomic<int64_t> skipped_{0};
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
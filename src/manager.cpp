@@ -0,0 +1,96 @@
+#include "manager.hpp"
+#include <string.h>
+
+VAccelManager::VAccelManager(const char* type, int workers, bool swFallback) :
+    vatype_(type),
+    workers_(workers),
+    swFallback_(swFallback)
+{
+}
+
+VAccelManager::~VAccelManager()
+{
+    pool_.reset();
+    streams_.clear();
+    av_buffer_unref(&hwDeviceCtx_);
+}
+
+int VAccelManager::init()
+{
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+
+    /* without a device every stream decodes in software on its own threads */
+    if (strcmp(vatype_, "sw")) {
+        type = av_hwdevice_find_type_by_name(vatype_);
+        if (type == AV_HWDEVICE_TYPE_NONE ||
+            av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
+            fprintf(stderr, "Failed to create specified HW device.\n");
+            if (!swFallback_)
+                return -1;
+            /* addStream() then gives every stream a single decode thread */
+            vatype_ = "sw";
+        }
+    }
+
+    pool_.reset(new VThreadPool(workers_));
+    return 0;
+}
+
+int VAccelManager::addStream(const char* inf, const VAccelOptions& opts)
+{
+    std::unique_ptr<Stream> s(new Stream);
+
+    s->infile = inf;
+    s->opts = opts;
+    s->opts.hwDevice = hwDeviceCtx_;
+    if (!hwDeviceCtx_ && s->opts.threads == 0) {
+        /* the pool already runs streams in parallel, don't oversubscribe the cores */
+        s->opts.threads = 1;
+    }
+    s->accel.reset(new VAccel(s->infile.c_str(), "out.yuv", vatype_));
+    streams_.push_back(std::move(s));
+
+    return (int)streams_.size() - 1;
+}
+
+int VAccelManager::run(const Callback& cb)
+{
+    if (!pool_) {
+        fprintf(stderr, "VAccelManager is not initialized\n");
+        return -1;
+    }
+
+    for (int i = 0; i < (int)streams_.size(); i++)
+        pool_->submit(std::bind(&VAccelManager::step, this, i, &cb));
+    pool_->wait();
+
+    for (size_t i = 0; i < streams_.size(); i++) {
+        if (streams_[i]->error < 0 && streams_[i]->error != AVERROR_EOF)
+            return streams_[i]->error;
+    }
+    return 0;
+}
+
+void VAccelManager::step(int id, const Callback* cb)
+{
+    Stream *s = streams_[id].get();
+    int ret = 0;
+
+    if (!s->opened) {
+        s->opened = true;
+        if ((ret = s->accel->init(s->opts)) < 0) {
+            fprintf(stderr, "Failed to open stream %d (%s)\n", id, s->infile.c_str());
+            s->error = ret;
+            return;
+        }
+    }
+
+    if ((ret = s->accel->getFrame(&s->frame)) < 0) {
+        s->error = ret;
+        return;
+    }
+    (*cb)(id, &s->frame);
+
+    /* requeue behind the other streams so every stream gets its turn */
+    pool_->submit(std::bind(&VAccelManager::step, this, id, cb));
+}
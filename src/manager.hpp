@@ -0,0 +1,57 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "accel.hpp"
+#include "threadpool.hpp"
+
+// Decodes many streams on one hardware device. The manager creates the device
+// context once and every VAccel takes a reference to it; decoding is scheduled on
+// a fixed worker pool one frame at a time, so streams are served round robin and a
+// stream is never worked on by two threads at once.
+class VAccelManager
+{
+public:
+    // called on a worker thread for every decoded frame, concurrently for
+    // different streams but never concurrently for the same stream
+    typedef std::function<void(int stream, VFrame* frame)> Callback;
+
+    // with swFallback, streams decode in software when the device cannot be
+    // created, as VAccelOptions::swFallback does for a single stream
+    VAccelManager(const char* type="vaapi", int workers=0, bool swFallback=true);
+    ~VAccelManager();
+
+    int init();
+    // returns the stream id, the decoder itself is opened on the pool by run()
+    int addStream(const char* inf, const VAccelOptions& opts = VAccelOptions());
+    // decode all streams to the end, returns 0 or the first error other than EOF
+    int run(const Callback& cb);
+
+    int getStreamCount() { return (int)streams_.size(); }
+    VAccel* getStream(int id) { return streams_[id]->accel.get(); }
+    int getStreamError(int id) { return streams_[id]->error; }
+
+private:
+    struct Stream
+    {
+        std::string infile;
+        VAccelOptions opts;
+        std::unique_ptr<VAccel> accel;
+        VFrame frame;
+        bool opened = false;
+        int error = 0;
+    };
+
+    void step(int id, const Callback* cb);
+
+private:
+    const char* vatype_;
+    AVBufferRef *hwDeviceCtx_ = nullptr;
+    std::vector<std::unique_ptr<Stream>> streams_;
+    std::unique_ptr<VThreadPool> pool_;
+    int workers_ = 0;
+    bool swFallback_ = true;
+};
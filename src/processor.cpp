@@ -0,0 +1,353 @@
+#include "processor.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+// smallest number of output rows worth a band of its own
+static const int minBandRows = 64;
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// whether swscale's 16.16 step from src to dst rows has no rounding error
+static bool exactStep(int src, int dst)
+{
+    return dst > 0 && (((int64_t)src << 16) % dst) == 0;
+}
+
+// plane pointers of frame moved to (x, y), which is on the chroma grid
+static void offsetPlanes(const AVFrame* frame, int x, int y, const uint8_t* data[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    int steps[4] = {};
+
+    av_image_fill_max_pixsteps(steps, nullptr, desc);
+    for (int p = 0; p < 4; p++) {
+        bool chroma = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int px = chroma ? x >> desc->log2_chroma_w : x;
+        int py = chroma ? y >> desc->log2_chroma_h : y;
+        data[p] = frame->data[p] ? frame->data[p] + py * frame->linesize[p] + px * steps[p] : nullptr;
+    }
+}
+
+VProcessor::VProcessor(const std::vector<VOutputSpec>& outputs, int threads) :
+    outputs_(outputs.size()),
+    pool_(new VThreadPool(threads))
+{
+    for (size_t i = 0; i < outputs.size(); i++)
+        outputs_[i].spec = outputs[i];
+}
+
+VProcessor::~VProcessor()
+{
+    pool_.reset();
+    closeSw();
+}
+
+int VProcessor::process(VFrame* f, VFrame* outs)
+{
+    AVFrame *frame = av_frame_alloc();
+    int ret = 0;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+    if ((ret = f->refFrame(frame)) == 0)
+        ret = process(frame, outs);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+int VProcessor::process(const AVFrame* frame, VFrame* outs)
+{
+    AVFrame *host = nullptr;
+    int ret = 0;
+
+    if (!frame->hw_frames_ctx)
+        return processSw(frame, outs);
+
+    if (!vppFailed_ && (ret = processHw(frame, outs)) == 0)
+        return 0;
+    if (!vppFailed_) {
+        fprintf(stderr, "Scaling on the device failed, falling back to swscale\n");
+        vppFailed_ = true;
+        for (size_t i = 0; i < outputs_.size(); i++)
+            outputs_[i].filter.reset();
+    }
+
+    /* one download for all the outputs */
+    if (!(host = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = av_hwframe_transfer_data(host, frame, 0)) == 0 &&
+        (ret = av_frame_copy_props(host, frame)) == 0)
+        ret = processSw(host, outs);
+    else
+        fprintf(stderr, "Error transferring the data to system memory\n");
+    av_frame_free(&host);
+
+    return ret;
+}
+
+int VProcessor::processHw(const AVFrame* frame, VFrame* outs)
+{
+    AVFrame *scaled = av_frame_alloc();
+    AVFrame *host = av_frame_alloc();
+    int ret = 0;
+
+    if (!scaled || !host) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* the GPU reads the surface once per output, only the results are downloaded */
+    for (size_t i = 0; i < outputs_.size() && ret == 0; i++) {
+        Output& out = outputs_[i];
+        const VOutputSpec& spec = out.spec;
+
+        if (!out.filter) {
+            out.filter.reset(new VFilter(spec.width, spec.height,
+                                         spec.crop.width > 0 ? &spec.crop : nullptr,
+                                         spec.format ? spec.format : "nv12"));
+        }
+        if ((ret = av_frame_ref(scaled, frame)) < 0 ||
+            (ret = out.filter->push(scaled)) < 0 ||
+            (ret = out.filter->pull(scaled)) < 0)
+            break;
+
+        /* map the small surface and copy it out; the host format is left
+           unset, the mapping picks the surface's own (a VAAPI one is refused) */
+        if (av_hwframe_map(host, scaled, AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT) == 0) {
+            mapped_++;
+        } else {
+            av_frame_unref(host);
+            ret = av_hwframe_transfer_data(host, scaled, 0);
+            downloaded_++;
+        }
+        if (ret == 0)
+            ret = outs[i].copy(host);
+        av_frame_unref(host);
+        av_frame_unref(scaled);
+    }
+
+end:
+    av_frame_free(&scaled);
+    av_frame_free(&host);
+    return ret;
+}
+
+void VProcessor::closeSw()
+{
+    for (size_t i = 0; i < outputs_.size(); i++) {
+        for (size_t b = 0; b < outputs_[i].bands.size(); b++) {
+            Band& band = outputs_[i].bands[b];
+            sws_freeContext(band.sws);
+            av_freep(&band.scratch[0]);
+        }
+        outputs_[i].bands.clear();
+    }
+    srcFormat_ = -1;
+}
+
+int VProcessor::openSw(const AVFrame* frame)
+{
+    const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    int threads = pool_->size();
+
+    if (!srcDesc || srcDesc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+
+    for (size_t i = 0; i < outputs_.size(); i++) {
+        Output& out = outputs_[i];
+        const VOutputSpec& spec = out.spec;
+        const AVPixFmtDescriptor *dstDesc = nullptr;
+        int sx = 1 << srcDesc->log2_chroma_w, sy = 1 << srcDesc->log2_chroma_h;
+        int cw = 0, ch = 0, w = 0, h = 0, dy = 0, ps = 0, pd = 0, margin = 0, rows = 0, count = 0, k = 0;
+        bool vscale = false;
+
+        out.format = spec.format ? av_get_pix_fmt(spec.format) : frame->format;
+        if (!(dstDesc = av_pix_fmt_desc_get((AVPixelFormat)out.format)) ||
+            dstDesc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+            fprintf(stderr, "Unsupported output format %s\n", spec.format);
+            return AVERROR(EINVAL);
+        }
+        dy = 1 << dstDesc->log2_chroma_h;
+
+        /* source window on the chroma grid, clamped to the frame */
+        out.src.x = 0;
+        out.src.y = 0;
+        out.src.width = frame->width;
+        out.src.height = frame->height;
+        if (spec.crop.width > 0 && spec.crop.height > 0) {
+            out.src.x = FFMIN(FFMAX(spec.crop.x, 0), frame->width - 1) & ~(sx - 1);
+            out.src.y = FFMIN(FFMAX(spec.crop.y, 0), frame->height - 1) & ~(sy - 1);
+            out.src.width = FFMIN(spec.crop.width, frame->width - out.src.x);
+            out.src.height = FFMIN(spec.crop.height, frame->height - out.src.y);
+        }
+        cw = out.src.width;
+        ch = out.src.height;
+        w = spec.width > 0 ? spec.width : cw;
+        h = spec.height > 0 ? spec.height : ch;
+        if (cw <= 0 || ch <= 0 || h % dy) {
+            fprintf(stderr, "Invalid output %dx%d\n", w, h);
+            return AVERROR(EINVAL);
+        }
+
+        /* Bands start on a whole period of the vertical scale (ps source rows
+           for pd output rows) and of swscale's 8 row dither. When rows are
+           resampled, each band also scales a margin of rows above and below
+           that covers the filter taps and is thrown away. A band's scaler
+           only lands its taps where one scaler for the whole frame would when
+           the 16.16 vertical step of luma and chroma is exact, e.g. 2:1 or
+           3:2 but not 720 to 224 rows; anything else takes a single band. */
+        vscale = ch != h || sy != dy;
+        ps = ch / gcd(ch, h);
+        pd = h / gcd(ch, h);
+        for (k = 1; k <= 4; k *= 2) {
+            if ((k * ps) % sy == 0 && (k * pd) % dy == 0) {
+                ps *= k;
+                pd *= k;
+                break;
+            }
+        }
+        k = 8 / gcd(pd, 8);
+        ps *= k;
+        pd *= k;
+        if (vscale)
+            margin = ((3 * ((ch + h - 1) / h) + 4) * FFMAX(sy, dy) + ps - 1) / ps * pd;
+
+        /* no period on the chroma grid, one too long to split on, or a step
+           that does not divide evenly */
+        count = FFMAX(1, FFMIN(threads, h / FFMAX(minBandRows, margin)));
+        if (ps % sy || pd % dy || pd > h / count ||
+            (vscale && (!exactStep(ch, h) ||
+                        !exactStep(-((-ch) >> srcDesc->log2_chroma_h), h >> dstDesc->log2_chroma_h))))
+            count = 1;
+        rows = ((h + count - 1) / count + pd - 1) / pd * pd;
+        if (rows >= h)
+            rows = h;
+
+        for (int y = 0; y < h; y += rows) {
+            Band band;
+
+            band.y0 = y;
+            band.y1 = FFMIN(h, y + rows);
+            band.ext0 = band.y0 == 0 ? 0 : band.y0 - margin;
+            band.ext1 = band.y1 == h ? h : FFMIN(h, band.y1 + margin);
+            band.srcY = (int)((int64_t)band.ext0 * ps / pd);
+            band.srcRows = (band.ext1 == h ? ch : (int)((int64_t)band.ext1 * ps / pd)) - band.srcY;
+
+            band.sws = sws_getContext(cw, band.srcRows, (AVPixelFormat)frame->format,
+                                      w, band.ext1 - band.ext0, (AVPixelFormat)out.format,
+                                      SWS_BICUBIC, nullptr, nullptr, nullptr);
+            if (!band.sws) {
+                fprintf(stderr, "Cannot scale %s to %s\n", srcDesc->name, dstDesc->name);
+                out.bands.push_back(band);
+                return AVERROR(EINVAL);
+            }
+            if ((band.ext0 != band.y0 || band.ext1 != band.y1) &&
+                av_image_alloc(band.scratch, band.scratchLinesize, w, band.ext1 - band.ext0,
+                               (AVPixelFormat)out.format, VFrame::align) < 0) {
+                out.bands.push_back(band);
+                return AVERROR(ENOMEM);
+            }
+            out.bands.push_back(band);
+        }
+    }
+
+    srcWidth_ = frame->width;
+    srcHeight_ = frame->height;
+    srcFormat_ = frame->format;
+
+    return 0;
+}
+
+int VProcessor::processSw(const AVFrame* frame, VFrame* outs)
+{
+    std::atomic<int> error{0};
+    int ret = 0;
+
+    if (frame->format != srcFormat_ || frame->width != srcWidth_ || frame->height != srcHeight_) {
+        closeSw();
+        if ((ret = openSw(frame)) < 0) {
+            closeSw();
+            return ret;
+        }
+    }
+
+    for (size_t i = 0; i < outputs_.size(); i++) {
+        Output& out = outputs_[i];
+        int w = out.spec.width > 0 ? out.spec.width : out.src.width;
+        int h = out.bands.back().y1;
+        if ((ret = outs[i].allocate(w, h, out.format)) < 0)
+            return ret;
+    }
+
+    /* every band of every output at once, all reading the same source */
+    for (size_t i = 0; i < outputs_.size(); i++) {
+        for (size_t b = 0; b < outputs_[i].bands.size(); b++) {
+            Output *out = &outputs_[i];
+            Band *band = &out->bands[b];
+            VFrame *dst = &outs[i];
+            pool_->submit([this, frame, out, band, dst, &error] {
+                int r = scaleBand(frame, *out, *band, dst);
+                if (r < 0)
+                    error = r;
+            });
+        }
+    }
+    pool_->wait();
+
+    return error.load();
+}
+
+int VProcessor::scaleBand(const AVFrame* frame, Output& out, Band& band, VFrame* dst)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)out.format);
+    const uint8_t *src[4] = {};
+    uint8_t *data[4] = {};
+    int linesize[4] = {};
+    bool scratch = band.scratch[0] != nullptr;
+    int planes = dst->getPlaneCount();
+
+    offsetPlanes(frame, out.src.x, out.src.y + band.srcY, src);
+    for (int p = 0; p < planes; p++) {
+        int y = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) ?
+                band.ext0 >> desc->log2_chroma_h : band.ext0;
+        data[p] = scratch ? band.scratch[p] : dst->getData(p) + y * dst->getLinesize(p);
+        linesize[p] = scratch ? band.scratchLinesize[p] : dst->getLinesize(p);
+    }
+
+    if (sws_scale(band.sws, src, frame->linesize, 0, band.srcRows, data, linesize) < 0)
+        return AVERROR(EINVAL);
+    if (!scratch)
+        return 0;
+
+    /* keep the band's own rows, the margin only fed the filter */
+    for (int p = 0; p < planes; p++) {
+        int shift = (p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) ?
+                    desc->log2_chroma_h : 0;
+        int skip = (band.y0 - band.ext0) >> shift;
+        int rows = (band.y1 - band.y0) >> shift;
+        for (int y = 0; y < rows; y++) {
+            memcpy(dst->getData(p) + ((band.y0 >> shift) + y) * dst->getLinesize(p),
+                   band.scratch[p] + (skip + y) * band.scratchLinesize[p], dst->getRowBytes(p));
+        }
+    }
+
+    return 0;
+}
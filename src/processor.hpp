@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "filter.hpp"
+#include "frame.hpp"
+#include "threadpool.hpp"
+
+struct AVFrame;
+struct SwsContext;
+
+struct VOutputSpec
+{
+    // 0 keeps the (cropped) size
+    int width = 0;
+    int height = 0;
+    // window of the source to scale, width 0 for the whole frame
+    VRect crop = {};
+    // AVPixelFormat name, null keeps the source format (NV12 for surfaces)
+    const char* format = nullptr;
+};
+
+// Produces several scaled/converted copies of each decoded frame in one call,
+// e.g. an archive copy, a detector input and a classifier crop, so every
+// consumer is fed from a single decode and a single read of the source.
+// Device surfaces are scaled on the GPU with one scale_vaapi graph per output
+// and only the small results are downloaded; when VPP is unavailable the
+// surface is downloaded once and handled like a host frame. Host frames go
+// through swscale, every output cut into bands of rows scaled in parallel on
+// a thread pool when the bands give the same bytes as one scaler would.
+class VProcessor
+{
+public:
+    explicit VProcessor(const std::vector<VOutputSpec>& outputs, int threads=0);
+    ~VProcessor();
+
+    int getOutputCount() { return (int)outputs_.size(); }
+    // outs holds getOutputCount() frames, output i is written to outs[i]
+    int process(const AVFrame* frame, VFrame* outs);
+    int process(VFrame* f, VFrame* outs);
+    // device outputs read through a mapping and through a full download
+    int64_t getMappedOutputs() { return mapped_; }
+    int64_t getDownloadedOutputs() { return downloaded_; }
+
+private:
+    struct Band
+    {
+        SwsContext *sws = nullptr;
+        // output rows written by this band
+        int y0 = 0;
+        int y1 = 0;
+        // rows scaled including the margin, the margin goes to scratch
+        int ext0 = 0;
+        int ext1 = 0;
+        int srcY = 0;
+        int srcRows = 0;
+        uint8_t *scratch[4] = {};
+        int scratchLinesize[4] = {};
+    };
+
+    struct Output
+    {
+        VOutputSpec spec;
+        int format = -1;
+        VRect src = {};
+        std::vector<Band> bands;
+        std::unique_ptr<VFilter> filter;
+    };
+
+    int processHw(const AVFrame* frame, VFrame* outs);
+    int processSw(const AVFrame* frame, VFrame* outs);
+    int openSw(const AVFrame* frame);
+    void closeSw();
+    int scaleBand(const AVFrame* frame, Output& out, Band& band, VFrame* dst);
+
+private:
+    std::vector<Output> outputs_;
+    std::unique_ptr<VThreadPool> pool_;
+    // source the swscale bands are set up for
+    int srcWidth_ = 0;
+    int srcHeight_ = 0;
+    int srcFormat_ = -1;
+    bool vppFailed_ = false;
+    int64_t mapped_ = 0;
+    int64_t downloaded_ = 0;
+};
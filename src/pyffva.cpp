@@ -0,0 +1,255 @@
+// Thin Python binding over VAccel with zero-copy DLPack output.
+//
+//   import ffva, torch.utils.dlpack as dl
+//   d = ffva.Decoder("clip.mp4", "sw", 224, 224)
+//   y, uv = [dl.from_dlpack(c) for c in d.planes()]   # next frame, native planes
+//   x = dl.from_dlpack(d.batch(32, "nchw", "f32"))     # up to 32 frames as RGB
+//
+// planes() and batch() return None at the end of the stream. The capsules follow
+// the DLPack protocol ("dltensor", renamed "used_dltensor" once consumed); batch
+// buffers come from a VTensorPool and are reused after the consumer frees them.
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "accel.hpp"
+#include "tensor.hpp"
+
+struct Decoder
+{
+    PyObject_HEAD
+    // VAccel keeps the strings, these copies live as long as it does
+    char *path;
+    char *type;
+    VAccel *accel;
+    VFrame *frame;
+    VTensorPool *pool;
+    int32_t poolBatch;
+    VLayout poolLayout;
+    VDataType poolType;
+};
+
+static const char dltensorName[] = "dltensor";
+
+static void capsuleDestructor(PyObject* capsule)
+{
+    /* still named "dltensor" means nobody took ownership */
+    if (!PyCapsule_IsValid(capsule, dltensorName))
+        return;
+    DLManagedTensor *t = (DLManagedTensor*)PyCapsule_GetPointer(capsule, dltensorName);
+    if (t && t->deleter)
+        t->deleter(t);
+}
+
+static PyObject* toCapsule(DLManagedTensor* t)
+{
+    PyObject *capsule = nullptr;
+
+    if (!t) {
+        PyErr_SetString(PyExc_RuntimeError, "Can not export tensor");
+        return nullptr;
+    }
+    if (!(capsule = PyCapsule_New(t, dltensorName, capsuleDestructor)))
+        t->deleter(t);
+    return capsule;
+}
+
+static int decoderInit(Decoder* self, PyObject* args, PyObject* kwds)
+{
+    static const char *kwlist[] = { "path", "type", "width", "height", nullptr };
+    const char *path = nullptr, *type = "sw";
+    int width = 0, height = 0;
+    VAccelOptions opts;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sii", (char**)kwlist,
+                                     &path, &type, &width, &height))
+        return -1;
+
+    if (self->accel) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is already initialized");
+        return -1;
+    }
+    free(self->path);
+    free(self->type);
+    self->path = strdup(path);
+    self->type = strdup(type);
+    self->accel = new VAccel(self->path, "out.yuv", self->type);
+    self->frame = new VFrame();
+
+    opts.zeroCopy = true;
+    opts.outWidth = width;
+    opts.outHeight = height;
+    if (self->accel->init(opts) != 0) {
+        /* leave the object as new, so __init__ can be retried */
+        delete self->frame;
+        delete self->accel;
+        self->frame = nullptr;
+        self->accel = nullptr;
+        PyErr_Format(PyExc_RuntimeError, "Can not open %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void decoderDealloc(Decoder* self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    delete self->pool;
+    delete self->frame;
+    delete self->accel;
+    free(self->path);
+    free(self->type);
+    type->tp_free((PyObject*)self);
+    /* instances of a heap type hold a reference to it */
+    Py_DECREF(type);
+}
+
+static bool checkInit(Decoder* self)
+{
+    if (!self->accel)
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is not initialized");
+    return self->accel != nullptr;
+}
+
+static PyObject* decoderPlanes(Decoder* self, PyObject*)
+{
+    PyObject *planes = nullptr;
+    int ret = 0;
+
+    if (!checkInit(self))
+        return nullptr;
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->accel->getFrame(self->frame);
+    Py_END_ALLOW_THREADS
+    if (ret == AVERROR_EOF)
+        Py_RETURN_NONE;
+    if (ret < 0) {
+        PyErr_Format(PyExc_RuntimeError, "Decode failed (%d)", ret);
+        return nullptr;
+    }
+
+    int count = self->frame->getPlaneCount();
+    if (!(planes = PyTuple_New(count)))
+        return nullptr;
+    for (int p = 0; p < count; p++) {
+        PyObject *capsule = toCapsule(self->frame->toDLPack(p));
+        if (!capsule) {
+            Py_DECREF(planes);
+            return nullptr;
+        }
+        PyTuple_SET_ITEM(planes, p, capsule);
+    }
+    return planes;
+}
+
+static PyObject* decoderBatch(Decoder* self, PyObject* args)
+{
+    int n = 0, count = 0;
+    const char *layout = "nchw", *dtype = "u8";
+    VLayout l = VLAYOUT_NCHW;
+    VDataType t = VDTYPE_U8;
+    VTensor *tensor = nullptr;
+
+    if (!checkInit(self) || !PyArg_ParseTuple(args, "i|ss", &n, &layout, &dtype))
+        return nullptr;
+    if (n <= 0 || (strcmp(layout, "nchw") && strcmp(layout, "nhwc")) ||
+        (strcmp(dtype, "u8") && strcmp(dtype, "f16") && strcmp(dtype, "f32"))) {
+        PyErr_SetString(PyExc_ValueError, "batch(n > 0, 'nchw'|'nhwc', 'u8'|'f16'|'f32')");
+        return nullptr;
+    }
+    l = strcmp(layout, "nchw") ? VLAYOUT_NHWC : VLAYOUT_NCHW;
+    t = !strcmp(dtype, "f32") ? VDTYPE_FP32 : !strcmp(dtype, "f16") ? VDTYPE_FP16 : VDTYPE_U8;
+
+    if (!self->pool || self->poolBatch != n || self->poolLayout != l || self->poolType != t) {
+        delete self->pool;
+        self->pool = new VTensorPool(n, self->accel->getHeight(), self->accel->getWidth(), l, t);
+        self->poolBatch = n;
+        self->poolLayout = l;
+        self->poolType = t;
+    }
+    if (!(tensor = self->pool->acquire()))
+        return PyErr_NoMemory();
+
+    Py_BEGIN_ALLOW_THREADS
+    count = self->accel->getFrames(tensor, n);
+    Py_END_ALLOW_THREADS
+    if (count <= 0) {
+        self->pool->release(tensor);
+        if (count == AVERROR_EOF)
+            Py_RETURN_NONE;
+        PyErr_Format(PyExc_RuntimeError, "Decode failed (%d)", count);
+        return nullptr;
+    }
+
+    return toCapsule(tensor->toDLPack(self->pool));
+}
+
+static PyObject* decoderGetWidth(Decoder* self, void*)
+{
+    if (!checkInit(self))
+        return nullptr;
+    return PyLong_FromLong(self->accel->getWidth());
+}
+
+static PyObject* decoderGetHeight(Decoder* self, void*)
+{
+    if (!checkInit(self))
+        return nullptr;
+    return PyLong_FromLong(self->accel->getHeight());
+}
+
+static PyMethodDef decoderMethods[] = {
+    { "planes", (PyCFunction)decoderPlanes, METH_NOARGS,
+      "Decode the next frame, one DLPack capsule per plane, None at the end" },
+    { "batch", (PyCFunction)decoderBatch, METH_VARARGS,
+      "batch(n, layout='nchw', dtype='u8'): up to n RGB frames as one DLPack capsule" },
+    { nullptr, nullptr, 0, nullptr },
+};
+
+static PyGetSetDef decoderGetSet[] = {
+    { (char*)"width", (getter)decoderGetWidth, nullptr, nullptr, nullptr },
+    { (char*)"height", (getter)decoderGetHeight, nullptr, nullptr, nullptr },
+    { nullptr, nullptr, nullptr, nullptr, nullptr },
+};
+
+// a heap type from a spec, every field spelled out whatever the Python version
+static PyType_Slot decoderSlots[] = {
+    { Py_tp_doc, (void*)"Decoder(path, type='sw', width=0, height=0)" },
+    { Py_tp_new, (void*)PyType_GenericNew },
+    { Py_tp_init, (void*)decoderInit },
+    { Py_tp_dealloc, (void*)decoderDealloc },
+    { Py_tp_methods, decoderMethods },
+    { Py_tp_getset, decoderGetSet },
+    { 0, nullptr },
+};
+
+static PyType_Spec decoderSpec = {
+    "ffva.Decoder", sizeof(Decoder), 0, Py_TPFLAGS_DEFAULT, decoderSlots,
+};
+
+static PyModuleDef ffvaModule = {
+    PyModuleDef_HEAD_INIT, "ffva", "Video decode with zero-copy DLPack output", -1,
+    nullptr, nullptr, nullptr, nullptr, nullptr,
+};
+
+PyMODINIT_FUNC PyInit_ffva(void)
+{
+    PyObject *m = nullptr;
+    PyObject *type = nullptr;
+
+    if (!(type = PyType_FromSpec(&decoderSpec)))
+        return nullptr;
+    if (!(m = PyModule_Create(&ffvaModule))) {
+        Py_DECREF(type);
+        return nullptr;
+    }
+    if (PyModule_AddObject(m, "Decoder", type) < 0) {
+        Py_DECREF(type);
+        Py_DECREF(m);
+        return nullptr;
+    }
+    return m;
+}
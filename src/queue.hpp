@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+// Bounded single-producer/single-consumer ring buffer, no locks on the hot path.
+// The blocking push()/pop() spin briefly, then back off to short sleeps, and give
+// up once stop is raised so pipeline threads can be torn down.
+template <typename T>
+class VQueue
+{
+public:
+    explicit VQueue(size_t capacity) :
+        size_(capacity + 1),
+        items_(new T[capacity + 1])
+    {
+    }
+
+    bool tryPush(const T& item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = (tail + 1) % size_;
+        if (next == head_.load(std::memory_order_acquire))
+            return false;
+
+        items_[tail] = item;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+
+        item = items_[head];
+        head_.store((head + 1) % size_, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T& item, const std::atomic<bool>& stop)
+    {
+        for (int spin = 0; !tryPush(item); spin++) {
+            if (stop.load(std::memory_order_relaxed))
+                return false;
+            backoff(spin);
+        }
+        return true;
+    }
+
+    bool pop(T& item, const std::atomic<bool>& stop)
+    {
+        for (int spin = 0; !tryPop(item); spin++) {
+            if (stop.load(std::memory_order_relaxed))
+                return false;
+            backoff(spin);
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return (tail + size_ - head) % size_;
+    }
+
+    size_t capacity() const { return size_ - 1; }
+
+private:
+    static void backoff(int spin)
+    {
+        if (spin < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+private:
+    const size_t size_;
+    std::unique_ptr<T[]> items_;
+    // keep producer and consumer indices on separate cache lines
+    char pad0_[64];
+    std::atomic<size_t> head_{0};
+    char pad1_[64];
+    std::atomic<size_t> tail_{0};
+};
@@ -0,0 +1,305 @@
+#include "shard.hpp"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+}
+
+// shard layout: header, count records every recordStride bytes from dataOffset,
+// count int64 frame numbers at indexOffset
+struct VShardHeader
+{
+    char magic[4];
+    uint32_t version;
+    int64_t srcSize;
+    int64_t srcMtime;
+    uint64_t key;
+    int64_t count;
+    int64_t recordSize;
+    int64_t recordStride;
+    int64_t dataOffset;
+    int64_t indexOffset;
+    int32_t height;
+    int32_t width;
+    uint32_t layout;
+    uint32_t dtype;
+    float mean[3];
+    float std[3];
+};
+
+static const char shardMagic[4] = { 'V', 'S', 'H', 'D' };
+static const uint32_t shardVersion = 1;
+// records start on a page and stay cache line (and SIMD load) aligned after it
+static const int64_t shardDataOffset = 4096;
+static const size_t recordAlign = 64;
+
+static size_t recordSize(const VShardFormat& f)
+{
+    size_t elem = (f.dtype == VDTYPE_FP32) ? 4 : (f.dtype == VDTYPE_FP16) ? 2 : 1;
+    return (size_t)3 * f.height * f.width * elem;
+}
+
+static bool formatMatches(const VShardFormat& f, VTensor* t)
+{
+    if (t->getHeight() != f.height || t->getWidth() != f.width ||
+        t->getLayout() != f.layout || t->getDataType() != f.dtype)
+        return false;
+    /* u8 records are not normalized */
+    if (f.dtype == VDTYPE_U8)
+        return true;
+    return !memcmp(t->getMean(), f.mean, sizeof(f.mean)) && !memcmp(t->getStd(), f.std, sizeof(f.std));
+}
+
+VShardWriter::VShardWriter()
+{
+}
+
+VShardWriter::~VShardWriter()
+{
+    abort();
+}
+
+int VShardWriter::open(const char* path, const VShardFormat& format, int64_t srcSize, int64_t srcMtime)
+{
+    char tmp[1024];
+
+    abort();
+    if (format.height <= 0 || format.width <= 0)
+        return -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (!(fp_ = fopen(tmp, "wb"))) {
+        fprintf(stderr, "Cannot write shard file %s\n", tmp);
+        return -1;
+    }
+    /* the header is written last, once the count and the index are known */
+    if (fseek(fp_, shardDataOffset, SEEK_SET) != 0) {
+        fclose(fp_);
+        fp_ = nullptr;
+        unlink(tmp);
+        return -1;
+    }
+
+    path_ = path;
+    tmp_ = tmp;
+    format_ = format;
+    srcSize_ = srcSize;
+    srcMtime_ = srcMtime;
+    recordSize_ = recordSize(format);
+    recordStride_ = (recordSize_ + recordAlign - 1) / recordAlign * recordAlign;
+    frames_.clear();
+
+    return 0;
+}
+
+int VShardWriter::append(const uint8_t* record, int64_t frame)
+{
+    static const uint8_t zeros[recordAlign] = {};
+    size_t pad = recordStride_ - recordSize_;
+
+    if (!fp_)
+        return -1;
+    if (fwrite(record, 1, recordSize_, fp_) != recordSize_ ||
+        (pad && fwrite(zeros, 1, pad, fp_) != pad)) {
+        fprintf(stderr, "Cannot write shard file %s\n", tmp_.c_str());
+        abort();
+        return -1;
+    }
+    frames_.push_back(frame);
+
+    return 0;
+}
+
+int VShardWriter::finish()
+{
+    VShardHeader hdr = {};
+    bool ok = true;
+
+    if (!fp_)
+        return -1;
+
+    memcpy(hdr.magic, shardMagic, 4);
+    hdr.version = shardVersion;
+    hdr.srcSize = srcSize_;
+    hdr.srcMtime = srcMtime_;
+    hdr.key = format_.key;
+    hdr.count = (int64_t)frames_.size();
+    hdr.recordSize = recordSize_;
+    hdr.recordStride = recordStride_;
+    hdr.dataOffset = shardDataOffset;
+    hdr.indexOffset = shardDataOffset + hdr.count * hdr.recordStride;
+    hdr.height = format_.height;
+    hdr.width = format_.width;
+    hdr.layout = format_.layout;
+    hdr.dtype = format_.dtype;
+    memcpy(hdr.mean, format_.mean, sizeof(hdr.mean));
+    memcpy(hdr.std, format_.std, sizeof(hdr.std));
+
+    ok = fwrite(frames_.data(), sizeof(int64_t), frames_.size(), fp_) == frames_.size() &&
+         fseek(fp_, 0, SEEK_SET) == 0 &&
+         fwrite(&hdr, sizeof(hdr), 1, fp_) == 1;
+    ok = (fclose(fp_) == 0) && ok;
+    fp_ = nullptr;
+
+    if (!ok || rename(tmp_.c_str(), path_.c_str()) != 0) {
+        fprintf(stderr, "Cannot write shard file %s\n", path_.c_str());
+        unlink(tmp_.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+bool VShardWriter::matches(VTensor* t)
+{
+    return formatMatches(format_, t);
+}
+
+void VShardWriter::abort()
+{
+    if (!fp_)
+        return;
+    fclose(fp_);
+    fp_ = nullptr;
+    unlink(tmp_.c_str());
+}
+
+VShardReader::VShardReader()
+{
+}
+
+VShardReader::~VShardReader()
+{
+    close();
+}
+
+void VShardReader::close()
+{
+    if (map_)
+        munmap(map_, mapSize_);
+    map_ = nullptr;
+    mapSize_ = 0;
+    count_ = 0;
+    data_ = nullptr;
+    frames_ = nullptr;
+}
+
+int VShardReader::open(const char* path, int64_t srcSize, int64_t srcMtime, uint64_t key)
+{
+    struct stat st;
+    const VShardHeader *hdr = nullptr;
+    int fd = -1;
+
+    close();
+    if ((fd = ::open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < shardDataOffset) {
+        ::close(fd);
+        return -1;
+    }
+
+    /* private and writable, so map() can hand out plain tensors: a write
+       copies the page and never reaches the file */
+    mapSize_ = st.st_size;
+    map_ = mmap(nullptr, mapSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        mapSize_ = 0;
+        return -1;
+    }
+
+    /* the stride and count are bounded by the file before they are
+       multiplied, as for the index sidecar */
+    hdr = (const VShardHeader*)map_;
+    format_.height = hdr->height;
+    format_.width = hdr->width;
+    format_.layout = (VLayout)hdr->layout;
+    format_.dtype = (VDataType)hdr->dtype;
+    if (memcmp(hdr->magic, shardMagic, 4) || hdr->version != shardVersion ||
+        hdr->srcSize != srcSize || hdr->srcMtime != srcMtime || hdr->key != key ||
+        hdr->height <= 0 || hdr->width <= 0 || hdr->layout > VLAYOUT_NHWC || hdr->dtype > VDTYPE_FP32 ||
+        hdr->count < 0 || hdr->recordSize != (int64_t)recordSize(format_) ||
+        hdr->recordStride < hdr->recordSize || hdr->recordStride % recordAlign ||
+        hdr->recordStride > (int64_t)mapSize_ ||
+        hdr->count > (int64_t)(mapSize_ / (hdr->recordStride + sizeof(int64_t))) ||
+        hdr->dataOffset != shardDataOffset ||
+        hdr->indexOffset != hdr->dataOffset + hdr->count * hdr->recordStride ||
+        mapSize_ != (size_t)(hdr->indexOffset + hdr->count * (int64_t)sizeof(int64_t))) {
+        close();
+        return -1;
+    }
+
+    memcpy(format_.mean, hdr->mean, sizeof(format_.mean));
+    memcpy(format_.std, hdr->std, sizeof(format_.std));
+    format_.key = hdr->key;
+    count_ = hdr->count;
+    recordSize_ = hdr->recordSize;
+    recordStride_ = hdr->recordStride;
+    data_ = (const uint8_t*)map_ + hdr->dataOffset;
+    frames_ = (const int64_t*)((const uint8_t*)map_ + hdr->indexOffset);
+    /* epochs stream through the records, let the kernel read ahead */
+    madvise(map_, mapSize_, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+bool VShardReader::matches(VTensor* t)
+{
+    return formatMatches(format_, t);
+}
+
+int64_t VShardReader::findFrame(int64_t k)
+{
+    int64_t lo = 0, hi = count_;
+
+    /* records are in source order */
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (frames_[mid] < k)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int VShardReader::read(VTensor* t, int64_t first, int n)
+{
+    int count = 0;
+
+    if (!map_ || !matches(t))
+        return AVERROR(EINVAL);
+    if (n > t->getBatch())
+        n = t->getBatch();
+
+    for (; count < n && first + count < count_; count++)
+        memcpy(t->getSlot(count), getRecord(first + count), recordSize_);
+
+    t->setCount(count);
+    return (count > 0 || n <= 0) ? count : AVERROR_EOF;
+}
+
+int VShardReader::map(VTensor* t, int64_t first, int n)
+{
+    int ret = 0;
+
+    if (!map_ || recordStride_ != recordSize_ || n <= 0)
+        return AVERROR(EINVAL);
+    if (first >= count_)
+        return AVERROR_EOF;
+    if (n > count_ - first)
+        n = (int)(count_ - first);
+
+    if ((ret = t->wrap((void*)getRecord(first), n * recordSize_, n, format_.height,
+                       format_.width, format_.layout, format_.dtype)) < 0)
+        return ret;
+    t->setNormalize(format_.mean, format_.std);
+    t->setCount(n);
+
+    return n;
+}
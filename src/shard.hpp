@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "tensor.hpp"
+
+// Shape and preprocessing of the records of a shard, fixed when it is written.
+// key identifies whatever else produced the pixels (source, crop, scale,
+// sampling, ...); a reader only accepts a shard written with the same one.
+struct VShardFormat
+{
+    int32_t height = 0;
+    int32_t width = 0;
+    VLayout layout = VLAYOUT_NCHW;
+    VDataType dtype = VDTYPE_U8;
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    float std[3] = { 1.0f, 1.0f, 1.0f };
+    uint64_t key = 0;
+};
+
+// Decoded tensors spilled to local storage once and read back instead of
+// decoding again. Layout: header, records of one VTensor slot each starting on
+// recordAlign boundaries, then the index (source frame number of every record).
+// The writer streams records to "<path>.<pid>.tmp" and renames it on finish(),
+// so readers never map a partial shard.
+class VShardWriter
+{
+public:
+    VShardWriter();
+    ~VShardWriter();
+
+    // srcSize/srcMtime tie the shard to its video, as for the index sidecar
+    int open(const char* path, const VShardFormat& format, int64_t srcSize, int64_t srcMtime);
+    // one record of getRecordSize() bytes, frame is its number in the source
+    int append(const uint8_t* record, int64_t frame);
+    int finish();
+    // drop what was written, the shard at path is left as it was
+    void abort();
+
+    bool isOpen() { return fp_ != nullptr; }
+    bool matches(VTensor* t);
+    size_t getRecordSize() { return recordSize_; }
+    int64_t getCount() { return (int64_t)frames_.size(); }
+
+private:
+    FILE *fp_ = nullptr;
+    std::string path_;
+    std::string tmp_;
+    VShardFormat format_;
+    int64_t srcSize_ = 0;
+    int64_t srcMtime_ = 0;
+    size_t recordSize_ = 0;
+    size_t recordStride_ = 0;
+    std::vector<int64_t> frames_;
+};
+
+// Read-only view of a finished shard, memory-mapped. Records are copied into
+// tensor slots by read(), or handed out in place by map() when the records of
+// a batch are contiguous.
+class VShardReader
+{
+public:
+    VShardReader();
+    ~VShardReader();
+
+    // fails when the shard is missing, stale against srcSize/srcMtime or was
+    // written with another key
+    int open(const char* path, int64_t srcSize, int64_t srcMtime, uint64_t key);
+    void close();
+
+    bool isOpen() { return map_ != nullptr; }
+    const VShardFormat& getFormat() { return format_; }
+    // whether t has the shape, type and normalization of the records
+    bool matches(VTensor* t);
+    int64_t getCount() { return count_; }
+    int64_t getFrame(int64_t record) { return frames_[record]; }
+    const uint8_t* getRecord(int64_t record) { return data_ + record * recordStride_; }
+    // first record of frame k or later, getCount() when there is none
+    int64_t findFrame(int64_t k);
+
+    // copy up to n records from first into the slots of t, returns the number read
+    int read(VTensor* t, int64_t first, int n);
+    // wrap t around up to n records from first without copying; only when the
+    // record stride equals the slot size. Writes to t stay private to this
+    // process and the mapping must outlive t's use
+    int map(VTensor* t, int64_t first, int n);
+
+private:
+    void *map_ = nullptr;
+    size_t mapSize_ = 0;
+    VShardFormat format_;
+    int64_t count_ = 0;
+    size_t recordSize_ = 0;
+    size_t recordStride_ = 0;
+    const uint8_t *data_ = nullptr;
+    const int64_t *frames_ = nullptr;
+};
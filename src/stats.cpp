@@ -0,0 +1,255 @@
+#include "stats.hpp"
+#include <stdarg.h>
+#include <stdio.h>
+
+static const char* stageNames[VSTAGE_COUNT] = {
+    "read", "decode", "receive", "dedup", "filter", "transfer", "copy",
+};
+
+static const char* queueNames[VQUEUE_COUNT] = {
+    "packets", "decoded", "ready",
+};
+
+static void updateMax(std::atomic<uint64_t>& max, uint64_t value)
+{
+    uint64_t cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+        ;
+}
+
+static void appendf(std::string& s, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string& s, const char* fmt, ...)
+{
+    char buf[512];
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n > 0)
+        s.append(buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+VStats::VStats()
+{
+    reset();
+}
+
+const char* VStats::stageName(VStage stage)
+{
+    return (stage >= 0 && stage < VSTAGE_COUNT) ? stageNames[stage] : "unknown";
+}
+
+const char* VStats::queueName(VQueueId queue)
+{
+    return (queue >= 0 && queue < VQUEUE_COUNT) ? queueNames[queue] : "unknown";
+}
+
+void VStats::record(VStage stage, int64_t ns, size_t bytes)
+{
+    Stage& s = stages_[stage];
+    uint64_t us = 0;
+    int bucket = 0;
+
+    if (ns < 0)
+        ns = 0;
+    /* bucket i holds calls shorter than 2^i us */
+    if ((us = (uint64_t)ns / 1000) > 0)
+        bucket = 64 - __builtin_clzll(us);
+    if (bucket >= bucketCount)
+        bucket = bucketCount - 1;
+
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    s.totalNs.fetch_add(ns, std::memory_order_relaxed);
+    s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    updateMax(s.maxNs, ns);
+}
+
+void VStats::setDepth(VQueueId queue, size_t depth)
+{
+    queues_[queue].depth.store(depth, std::memory_order_relaxed);
+    updateMax(queues_[queue].maxDepth, depth);
+}
+
+void VStats::setCapacity(VQueueId queue, size_t capacity)
+{
+    queues_[queue].capacity.store(capacity, std::memory_order_relaxed);
+}
+
+void VStats::getStage(VStage stage, VStageStats* out) const
+{
+    const Stage& s = stages_[stage];
+
+    out->count = s.count.load(std::memory_order_relaxed);
+    out->bytes = s.bytes.load(std::memory_order_relaxed);
+    out->totalNs = s.totalNs.load(std::memory_order_relaxed);
+    out->maxNs = s.maxNs.load(std::memory_order_relaxed);
+    for (int i = 0; i < bucketCount; i++)
+        out->buckets[i] = s.buckets[i].load(std::memory_order_relaxed);
+}
+
+void VStats::getQueue(VQueueId queue, VQueueStats* out) const
+{
+    const Queue& q = queues_[queue];
+
+    out->depth = q.depth.load(std::memory_order_relaxed);
+    out->maxDepth = q.maxDepth.load(std::memory_order_relaxed);
+    out->capacity = q.capacity.load(std::memory_order_relaxed);
+}
+
+void VStats::reset()
+{
+    for (int i = 0; i < VSTAGE_COUNT; i++) {
+        Stage& s = stages_[i];
+        s.count = 0;
+        s.bytes = 0;
+        s.totalNs = 0;
+        s.maxNs = 0;
+        for (int j = 0; j < bucketCount; j++)
+            s.buckets[j] = 0;
+    }
+    /* capacities describe the configuration, not the traffic */
+    for (int i = 0; i < VQUEUE_COUNT; i++) {
+        queues_[i].depth = 0;
+        queues_[i].maxDepth = 0;
+    }
+    for (int i = 0; i < VCOUNTER_COUNT; i++)
+        counters_[i] = 0;
+}
+
+std::string VStats::toPrometheus(const char* labels, bool help) const
+{
+    std::string s;
+    std::string extra = (labels && *labels) ? std::string(",") + labels : std::string();
+    std::string only = (labels && *labels) ? std::string("{") + labels + "}" : std::string();
+    VStageStats st;
+    VQueueStats q;
+
+    if (help) {
+        s += "# HELP vadec_stage_seconds Latency of each decode stage.\n";
+        s += "# TYPE vadec_stage_seconds histogram\n";
+    }
+    for (int i = 0; i < VSTAGE_COUNT; i++) {
+        uint64_t cum = 0;
+
+        getStage((VStage)i, &st);
+        for (int j = 0; j < bucketCount - 1; j++) {
+            cum += st.buckets[j];
+            appendf(s, "vadec_stage_seconds_bucket{stage=\"%s\"%s,le=\"%g\"} %llu\n",
+                    stageNames[i], extra.c_str(), bucketBound(j), (unsigned long long)cum);
+        }
+        appendf(s, "vadec_stage_seconds_bucket{stage=\"%s\"%s,le=\"+Inf\"} %llu\n",
+                stageNames[i], extra.c_str(), (unsigned long long)st.count);
+        appendf(s, "vadec_stage_seconds_sum{stage=\"%s\"%s} %.9f\n",
+                stageNames[i], extra.c_str(), st.totalNs * 1e-9);
+        appendf(s, "vadec_stage_seconds_count{stage=\"%s\"%s} %llu\n",
+                stageNames[i], extra.c_str(), (unsigned long long)st.count);
+    }
+
+    if (help) {
+        s += "# HELP vadec_stage_bytes_total Bytes moved by each decode stage.\n";
+        s += "# TYPE vadec_stage_bytes_total counter\n";
+    }
+    for (int i = 0; i < VSTAGE_COUNT; i++) {
+        getStage((VStage)i, &st);
+        appendf(s, "vadec_stage_bytes_total{stage=\"%s\"%s} %llu\n",
+                stageNames[i], extra.c_str(), (unsigned long long)st.bytes);
+    }
+
+    if (help) {
+        s += "# HELP vadec_queue_depth Items waiting in each pipeline queue.\n";
+        s += "# TYPE vadec_queue_depth gauge\n";
+    }
+    for (int i = 0; i < VQUEUE_COUNT; i++) {
+        getQueue((VQueueId)i, &q);
+        appendf(s, "vadec_queue_depth{queue=\"%s\"%s} %llu\n",
+                queueNames[i], extra.c_str(), (unsigned long long)q.depth);
+    }
+    if (help) {
+        s += "# HELP vadec_queue_max_depth Highest depth seen in each pipeline queue.\n";
+        s += "# TYPE vadec_queue_max_depth gauge\n";
+    }
+    for (int i = 0; i < VQUEUE_COUNT; i++) {
+        getQueue((VQueueId)i, &q);
+        appendf(s, "vadec_queue_max_depth{queue=\"%s\"%s} %llu\n",
+                queueNames[i], extra.c_str(), (unsigned long long)q.maxDepth);
+    }
+    if (help) {
+        s += "# HELP vadec_queue_capacity Capacity of each pipeline queue.\n";
+        s += "# TYPE vadec_queue_capacity gauge\n";
+    }
+    for (int i = 0; i < VQUEUE_COUNT; i++) {
+        getQueue((VQueueId)i, &q);
+        appendf(s, "vadec_queue_capacity{queue=\"%s\"%s} %llu\n",
+                queueNames[i], extra.c_str(), (unsigned long long)q.capacity);
+    }
+
+    if (help) {
+        s += "# HELP vadec_frames_total Frames returned to the caller.\n";
+        s += "# TYPE vadec_frames_total counter\n";
+    }
+    appendf(s, "vadec_frames_total%s %llu\n", only.c_str(),
+            (unsigned long long)getCounter(VCOUNTER_FRAMES));
+    if (help) {
+        s += "# HELP vadec_frames_dropped_total Frames decoded but dropped by seeking or sampling.\n";
+        s += "# TYPE vadec_frames_dropped_total counter\n";
+    }
+    appendf(s, "vadec_frames_dropped_total%s %llu\n", only.c_str(),
+            (unsigned long long)getCounter(VCOUNTER_DROPPED));
+    if (help) {
+        s += "# HELP vadec_frames_duplicate_total Frames decoded but dropped as near-duplicates.\n";
+        s += "# TYPE vadec_frames_duplicate_total counter\n";
+    }
+    appendf(s, "vadec_frames_duplicate_total%s %llu\n", only.c_str(),
+            (unsigned long long)getCounter(VCOUNTER_DUPLICATES));
+    if (help) {
+        s += "# HELP vadec_frames_cached_total Frames returned from the frame cache.\n";
+        s += "# TYPE vadec_frames_cached_total counter\n";
+    }
+    appendf(s, "vadec_frames_cached_total%s %llu\n", only.c_str(),
+            (unsigned long long)getCounter(VCOUNTER_CACHED));
+    if (help) {
+        s += "# HELP vadec_errors_total Decode, filter and transfer errors.\n";
+        s += "# TYPE vadec_errors_total counter\n";
+    }
+    appendf(s, "vadec_errors_total%s %llu\n", only.c_str(),
+            (unsigned long long)getCounter(VCOUNTER_ERRORS));
+
+    return s;
+}
+
+std::string VStats::toJson() const
+{
+    std::string s;
+    VStageStats st;
+    VQueueStats q;
+
+    s += "{\"stages\":{";
+    for (int i = 0; i < VSTAGE_COUNT; i++) {
+        getStage((VStage)i, &st);
+        appendf(s, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"total_ns\":%llu,\"max_ns\":%llu,"
+                "\"buckets\":[", i ? "," : "", stageNames[i], (unsigned long long)st.count,
+                (unsigned long long)st.bytes, (unsigned long long)st.totalNs,
+                (unsigned long long)st.maxNs);
+        for (int j = 0; j < bucketCount; j++)
+            appendf(s, "%s%llu", j ? "," : "", (unsigned long long)st.buckets[j]);
+        s += "]}";
+    }
+    s += "},\"queues\":{";
+    for (int i = 0; i < VQUEUE_COUNT; i++) {
+        getQueue((VQueueId)i, &q);
+        appendf(s, "%s\"%s\":{\"depth\":%llu,\"max_depth\":%llu,\"capacity\":%llu}",
+                i ? "," : "", queueNames[i], (unsigned long long)q.depth,
+                (unsigned long long)q.maxDepth, (unsigned long long)q.capacity);
+    }
+    appendf(s, "},\"frames\":%llu,\"dropped\":%llu,\"duplicates\":%llu,\"cached\":%llu,\"errors\":%llu}",
+            (unsigned long long)getCounter(VCOUNTER_FRAMES),
+            (unsigned long long)getCounter(VCOUNTER_DROPPED),
+            (unsigned long long)getCounter(VCOUNTER_DUPLICATES),
+            (unsigned long long)getCounter(VCOUNTER_CACHED),
+            (unsigned long long)getCounter(VCOUNTER_ERRORS));
+
+    return s;
+}
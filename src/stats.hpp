@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+enum VStage
+{
+    // av_read_frame(), bytes are the packet sizes
+    VSTAGE_READ = 0,
+    // avcodec_send_packet()
+    VSTAGE_DECODE,
+    // avcodec_receive_frame(), counted for each frame returned
+    VSTAGE_RECEIVE,
+    // VDedup signature and comparison, counted for each frame checked
+    VSTAGE_DEDUP,
+    // VFilter push/pull
+    VSTAGE_FILTER,
+    // av_hwframe_transfer_data(), bytes are the downloaded image sizes
+    VSTAGE_TRANSFER,
+    // copy or conversion into the caller's VFrame / VTensor slot
+    VSTAGE_COPY,
+    VSTAGE_COUNT,
+};
+
+enum VQueueId
+{
+    VQUEUE_PACKETS = 0,
+    VQUEUE_DECODED,
+    VQUEUE_READY,
+    VQUEUE_COUNT,
+};
+
+enum VCounter
+{
+    // handed out by getFrame()/getFrames()
+    VCOUNTER_FRAMES = 0,
+    // decoded but dropped by seeking or stride sampling
+    VCOUNTER_DROPPED,
+    // decoded but dropped as near-duplicates of the last returned frame
+    VCOUNTER_DUPLICATES,
+    // handed out from the frame cache without decoding
+    VCOUNTER_CACHED,
+    VCOUNTER_ERRORS,
+    VCOUNTER_COUNT,
+};
+
+struct VStageStats
+{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    // buckets[i] counts calls faster than VStats::bucketBound(i), the last
+    // one everything slower
+    uint64_t buckets[21];
+};
+
+struct VQueueStats
+{
+    uint64_t depth;
+    uint64_t maxDepth;
+    uint64_t capacity;
+};
+
+// Counters and latency histograms of one VAccel. Every update is a handful of
+// relaxed atomic adds so it stays on in production and can be read from any
+// thread while the pipeline runs; a snapshot is not atomic across fields.
+// Histogram buckets are powers of two from 1 us to ~0.5 s.
+class VStats
+{
+public:
+    static const int bucketCount = 21;
+
+    VStats();
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record(VStage stage, int64_t ns, size_t bytes=0);
+    void add(VCounter counter, uint64_t n=1)
+    {
+        counters_[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+    void setDepth(VQueueId queue, size_t depth);
+    void setCapacity(VQueueId queue, size_t capacity);
+
+    void getStage(VStage stage, VStageStats* out) const;
+    void getQueue(VQueueId queue, VQueueStats* out) const;
+    uint64_t getCounter(VCounter counter) const
+    {
+        return counters_[counter].load(std::memory_order_relaxed);
+    }
+    void reset();
+
+    // Prometheus text exposition; labels (e.g. "stream=\"3\"") are added to
+    // every sample, help=false leaves out the HELP/TYPE lines
+    std::string toPrometheus(const char* labels=nullptr, bool help=true) const;
+    std::string toJson() const;
+
+    static const char* stageName(VStage stage);
+    static const char* queueName(VQueueId queue);
+    // upper bound of bucket i in seconds
+    static double bucketBound(int i) { return (double)(1LL << i) * 1e-6; }
+
+private:
+    struct Stage
+    {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> totalNs;
+        std::atomic<uint64_t> maxNs;
+        std::atomic<uint64_t> buckets[bucketCount];
+    };
+
+    struct Queue
+    {
+        std::atomic<uint64_t> depth;
+        std::atomic<uint64_t> maxDepth;
+        std::atomic<uint64_t> capacity;
+    };
+
+    Stage stages_[VSTAGE_COUNT];
+    Queue queues_[VQUEUE_COUNT];
+    std::atomic<uint64_t> counters_[VCOUNTER_COUNT];
+};
+
+// Times the enclosing scope into one stage of stats, which may be null.
+class VStatsTimer
+{
+public:
+    VStatsTimer(VStats* stats, VStage stage, size_t bytes=0) :
+        stats_(stats),
+        stage_(stage),
+        bytes_(bytes),
+        start_(stats ? VStats::now() : 0)
+    {
+    }
+
+    ~VStatsTimer()
+    {
+        if (stats_)
+            stats_->record(stage_, VStats::now() - start_, bytes_);
+    }
+
+    void setBytes(size_t bytes) { bytes_ = bytes; }
+    // leave this call out, e.g. when the stage had nothing to do
+    void cancel() { stats_ = nullptr; }
+
+private:
+    VStats *stats_;
+    VStage stage_;
+    size_t bytes_;
+    int64_t start_;
+};
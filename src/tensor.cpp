@@ -0,0 +1,223 @@
+#include "tensor.hpp"
+#include <stdio.h>
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+// holds a batch until the consumer is done, then hands it back to its pool
+struct VTensorExport
+{
+    DLManagedTensor managed;
+    int64_t shape[4];
+    int64_t strides[4];
+    std::shared_ptr<void> pool;
+    VTensor *tensor;
+};
+
+VTensor::VTensor()
+{
+}
+
+VTensor::~VTensor()
+{
+    release();
+}
+
+size_t VTensor::getElemSize()
+{
+    switch (dtype_) {
+    case VDTYPE_FP16:
+        return 2;
+    case VDTYPE_FP32:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+int VTensor::allocate(int32_t batch, int32_t height, int32_t width, VLayout layout, VDataType dtype)
+{
+    if (batch <= 0 || height <= 0 || width <= 0)
+        return AVERROR(EINVAL);
+
+    setShape(batch, height, width, layout, dtype);
+    if (owned_ && capacity_ >= getSize())
+        return 0;
+
+    release();
+    if (!(data_ = (uint8_t*)av_malloc(getSize()))) {
+        fprintf(stderr, "Can not alloc tensor buffer\n");
+        return AVERROR(ENOMEM);
+    }
+    capacity_ = getSize();
+    owned_ = true;
+
+    return 0;
+}
+
+int VTensor::wrap(void* data, size_t bytes, int32_t batch, int32_t height, int32_t width,
+                  VLayout layout, VDataType dtype)
+{
+    if (!data || batch <= 0 || height <= 0 || width <= 0)
+        return AVERROR(EINVAL);
+
+    release();
+    setShape(batch, height, width, layout, dtype);
+    if (bytes < getSize()) {
+        fprintf(stderr, "Tensor buffer too small, %zu < %zu bytes\n", bytes, getSize());
+        return AVERROR(EINVAL);
+    }
+    data_ = (uint8_t*)data;
+    capacity_ = bytes;
+    owned_ = false;
+
+    return 0;
+}
+
+void VTensor::setNormalize(const float mean[3], const float std[3])
+{
+    for (int i = 0; i < 3; i++) {
+        mean_[i] = mean[i];
+        std_[i] = std[i];
+    }
+}
+
+DLManagedTensor* VTensor::toDLPack(VTensorPool* pool)
+{
+    VTensorExport *ctx = nullptr;
+    int64_t n = count_ > 0 ? count_ : batch_;
+
+    if (!data_)
+        return nullptr;
+
+    ctx = new VTensorExport();
+    ctx->tensor = this;
+    if (pool)
+        ctx->pool = pool->state_;
+
+    DLTensor& t = ctx->managed.dl_tensor;
+    t.data = data_;
+    t.device.device_type = kDLCPU;
+    t.device.device_id = 0;
+    t.ndim = 4;
+    t.dtype.code = (dtype_ == VDTYPE_U8) ? kDLUInt : kDLFloat;
+    t.dtype.bits = getElemSize() * 8;
+    t.dtype.lanes = 1;
+    t.shape = ctx->shape;
+    t.strides = ctx->strides;
+    t.byte_offset = 0;
+
+    ctx->shape[0] = n;
+    if (layout_ == VLAYOUT_NCHW) {
+        ctx->shape[1] = channels_;
+        ctx->shape[2] = height_;
+        ctx->shape[3] = width_;
+    } else {
+        ctx->shape[1] = height_;
+        ctx->shape[2] = width_;
+        ctx->shape[3] = channels_;
+    }
+    /* compact row-major, in elements */
+    ctx->strides[3] = 1;
+    for (int i = 2; i >= 0; i--)
+        ctx->strides[i] = ctx->strides[i + 1] * ctx->shape[i + 1];
+
+    ctx->managed.manager_ctx = ctx;
+    ctx->managed.deleter = [](DLManagedTensor* self) {
+        VTensorExport *ctx = (VTensorExport*)self->manager_ctx;
+        if (ctx->pool)
+            VTensorPool::recycle(std::static_pointer_cast<VTensorPool::State>(ctx->pool),
+                                 ctx->tensor);
+        delete ctx;
+    };
+    return &ctx->managed;
+}
+
+void VTensor::release()
+{
+    if (owned_)
+        av_free(data_);
+    data_ = nullptr;
+    capacity_ = 0;
+    owned_ = false;
+}
+
+void VTensor::setShape(int32_t batch, int32_t height, int32_t width, VLayout layout, VDataType dtype)
+{
+    batch_ = batch;
+    height_ = height;
+    width_ = width;
+    layout_ = layout;
+    dtype_ = dtype;
+    count_ = 0;
+}
+
+VTensorPool::VTensorPool(int32_t batch, int32_t height, int32_t width,
+                         VLayout layout, VDataType dtype) :
+    batch_(batch),
+    height_(height),
+    width_(width),
+    layout_(layout),
+    dtype_(dtype),
+    state_(std::make_shared<State>())
+{
+}
+
+VTensorPool::~VTensorPool()
+{
+    std::lock_guard<std::mutex> lock(state_->mutex);
+
+    /* tensors still exported are deleted by recycle() when they come back */
+    for (VTensor *t : state_->free)
+        delete t;
+    state_->free.clear();
+    state_->closed = true;
+}
+
+VTensor* VTensorPool::acquire()
+{
+    VTensor *t = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (!state_->free.empty()) {
+            t = state_->free.back();
+            state_->free.pop_back();
+        }
+    }
+    if (t) {
+        t->setCount(0);
+        return t;
+    }
+
+    t = new VTensor();
+    if (t->allocate(batch_, height_, width_, layout_, dtype_) < 0) {
+        delete t;
+        return nullptr;
+    }
+    return t;
+}
+
+void VTensorPool::release(VTensor* t)
+{
+    recycle(state_, t);
+}
+
+size_t VTensorPool::getFree()
+{
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->free.size();
+}
+
+void VTensorPool::recycle(const std::shared_ptr<State>& state, VTensor* t)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    if (state->closed) {
+        delete t;
+        return;
+    }
+    state->free.push_back(t);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dlpack.hpp"
+
+class VTensorPool;
+
+enum VLayout
+{
+    VLAYOUT_NCHW = 0,
+    VLAYOUT_NHWC,
+};
+
+enum VDataType
+{
+    VDTYPE_U8 = 0,
+    VDTYPE_FP16,
+    VDTYPE_FP32,
+};
+
+// Contiguous batch of N three-channel (RGB) images. The buffer is either owned
+// (allocate(), kept and reused while it is large enough) or supplied by the caller
+// (wrap(), never freed here). VAccel::getFrames() writes each frame straight into
+// its slot.
+class VTensor
+{
+public:
+    VTensor();
+    ~VTensor();
+
+    int allocate(int32_t batch, int32_t height, int32_t width,
+                 VLayout layout=VLAYOUT_NCHW, VDataType dtype=VDTYPE_U8);
+    int wrap(void* data, size_t bytes, int32_t batch, int32_t height, int32_t width,
+             VLayout layout=VLAYOUT_NCHW, VDataType dtype=VDTYPE_U8);
+
+    uint8_t* getData() { return data_; }
+    uint8_t* getSlot(int32_t index) { return data_ + index * getSlotSize(); }
+    size_t getSlotSize() { return (size_t)channels_ * height_ * width_ * getElemSize(); }
+    size_t getSize() { return getSlotSize() * batch_; }
+    size_t getElemSize();
+
+    int32_t getBatch() { return batch_; }
+    int32_t getChannels() { return channels_; }
+    int32_t getHeight() { return height_; }
+    int32_t getWidth() { return width_; }
+    VLayout getLayout() { return layout_; }
+    VDataType getDataType() { return dtype_; }
+
+    // per-channel (v / 255 - mean) / std applied to fp16/fp32 output
+    void setNormalize(const float mean[3], const float std[3]);
+    const float* getMean() { return mean_; }
+    const float* getStd() { return std_; }
+
+    // number of slots filled by the last VAccel::getFrames() call
+    int32_t getCount() { return count_; }
+    void setCount(int32_t count) { count_ = count; }
+
+    // DLPack view of the filled slots (all of them when getCount() is 0),
+    // [n, 3, h, w] or [n, h, w, 3]. With a pool the tensor must come from
+    // pool->acquire() and goes back to it when the consumer calls the
+    // deleter; without one the caller keeps this tensor alive until then.
+    DLManagedTensor* toDLPack(VTensorPool* pool=nullptr);
+
+private:
+    void release();
+    void setShape(int32_t batch, int32_t height, int32_t width, VLayout layout, VDataType dtype);
+
+private:
+    uint8_t *data_ = nullptr;
+    size_t capacity_ = 0;
+    bool owned_ = false;
+    int32_t batch_ = 0;
+    int32_t channels_ = 3;
+    int32_t height_ = 0;
+    int32_t width_ = 0;
+    int32_t count_ = 0;
+    VLayout layout_ = VLAYOUT_NCHW;
+    VDataType dtype_ = VDTYPE_U8;
+    float mean_[3] = { 0.0f, 0.0f, 0.0f };
+    float std_[3] = { 1.0f, 1.0f, 1.0f };
+};
+
+// Recycles batch tensors of one shape so exported batches cost no allocation
+// once the pool is warm. acquire() and release() may be called from any thread
+// (DLPack deleters run wherever the consumer frees the tensor); tensors still
+// exported when the pool is destroyed are freed by their deleter instead.
+class VTensorPool
+{
+public:
+    VTensorPool(int32_t batch, int32_t height, int32_t width,
+                VLayout layout=VLAYOUT_NCHW, VDataType dtype=VDTYPE_U8);
+    ~VTensorPool();
+
+    // a free tensor, or a new one when all are in use; null when out of memory
+    VTensor* acquire();
+    void release(VTensor* t);
+    size_t getFree();
+
+private:
+    friend class VTensor;
+
+    struct State
+    {
+        std::mutex mutex;
+        std::vector<VTensor*> free;
+        bool closed = false;
+    };
+
+    static void recycle(const std::shared_ptr<State>& state, VTensor* t);
+
+private:
+    int32_t batch_;
+    int32_t height_;
+    int32_t width_;
+    VLayout layout_;
+    VDataType dtype_;
+    std::shared_ptr<State> state_;
+};
@@ -1,6 +1,146 @@
 
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
 #include "accel.hpp"
+#include "cache.hpp"
 #include "frame.hpp"
+#include "loader.hpp"
+#include "writer.hpp"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+static uint64_t hashBytes(uint64_t h, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ data[i]) * 1099511628211ULL;
+    return h;
+}
+
+// FNV-1a of the visible bytes of every plane
+static uint64_t hashFrame(VFrame* f)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int p = 0; p < f->getPlaneCount(); p++) {
+        for (int y = 0; y < f->getPlaneHeight(p); y++)
+            h = hashBytes(h, f->getData(p) + y * f->getLinesize(p), f->getRowBytes(p));
+    }
+    return h;
+}
+
+// a second decode through the frame cache must hit on every frame and give
+// the bytes the first one decoded
+static int checkCache(const char* infile)
+{
+    VFrameCache cache(256 << 20);
+    std::vector<uint64_t> passes[2];
+    VAccelOptions opts;
+
+    opts.cache = &cache;
+    for (int pass = 0; pass < 2; pass++) {
+        VAccel accel(infile);
+        VFrame vf;
+        if (accel.init(opts) != 0)
+            return -1;
+        while (!accel.getFrame(&vf))
+            passes[pass].push_back(hashFrame(&vf));
+    }
+
+    if (passes[0].empty() || passes[0] != passes[1]) {
+        printf("Cached frames differ from the decoded ones!\n");
+        return -1;
+    }
+    if (cache.getHits() != passes[1].size()) {
+        printf("Frame cache hit %llu of %zu frames!\n", (unsigned long long)cache.getHits(),
+               passes[1].size());
+        return -1;
+    }
+    return 0;
+}
+
+// decode into tensors while writing a shard, then read the shard back, copied
+// and mapped: every record must hold the tensor it was written from
+static int checkShard(const char* infile)
+{
+    const char* path = "out.vshd";
+    std::vector<uint64_t> passes[3];
+    VAccelOptions opts;
+
+    opts.outWidth = 224;
+    opts.outHeight = 224;
+    opts.shard = path;
+    unlink(path);
+
+    for (int pass = 0; pass < 3; pass++) {
+        VAccel accel(infile);
+        VTensor t;
+        int n = 0;
+        if (accel.init(opts) != 0)
+            return -1;
+        if (accel.isShardRead() != (pass > 0)) {
+            printf("Shard %s was %s!\n", path, pass ? "not written" : "already there");
+            return -1;
+        }
+        if (pass < 2 && t.allocate(8, 224, 224) != 0)
+            return -1;
+        while ((n = (pass < 2) ? accel.getFrames(&t, 8) : accel.mapFrames(&t, 8)) > 0) {
+            for (int i = 0; i < n; i++)
+                passes[pass].push_back(hashBytes(14695981039346656037ULL, t.getSlot(i), t.getSlotSize()));
+        }
+    }
+    unlink(path);
+
+    if (passes[0].empty() || passes[0] != passes[1] || passes[0] != passes[2]) {
+        printf("Shard records differ from the decoded tensors!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// two passes over one epoch must give the same frames, and the decoders must
+// stay within the memory budget, plus the one frame each may go over by
+static int checkLoader(const char* infile)
+{
+    std::vector<std::string> files(3, infile);
+    std::vector<std::pair<int, int64_t>> passes[2];
+    VLoader loader(files);
+    VLoaderOptions opts;
+    size_t frameBytes = 0, maxQueued = 0;
+
+    opts.decoders = 2;
+    opts.memoryBudget = 4 << 20;
+    opts.framesPerFile = 20;
+    if (loader.init(opts) != 0)
+        return -1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        VFrame vf;
+        VSampleInfo info;
+        if (loader.startEpoch(1) != 0)
+            return -1;
+        while (!loader.next(&vf, &info)) {
+            size_t bytes = av_image_get_buffer_size((AVPixelFormat)vf.getFormat(),
+                                                    vf.getWidth(), vf.getHeight(), 1);
+            passes[pass].push_back(std::make_pair(info.file, info.frame));
+            frameBytes = FFMAX(frameBytes, bytes);
+            maxQueued = FFMAX(maxQueued, loader.getQueuedBytes());
+        }
+    }
+
+    if (passes[0].size() != files.size() * opts.framesPerFile || passes[0] != passes[1]) {
+        printf("VLoader epoch is not repeatable!\n");
+        return -1;
+    }
+    if (maxQueued > opts.memoryBudget + opts.decoders * frameBytes) {
+        printf("VLoader queued %zu bytes over a budget of %zu!\n", maxQueued, opts.memoryBudget);
+        return -1;
+    }
+    return 0;
+}
 
 int main (int argc, char** argv)
 {
@@ -21,9 +161,31 @@ int main (int argc, char** argv)
         return -1;
     }
 
+    VWriter writer("out.yuv");
+    if (writer.open() != 0) {
+        printf("VWriter open failed!\n");
+        return -1;
+    }
+
     VFrame vf;
     while (!accel.getFrame(&vf)) {
-        vf.saveFile();
+        writer.writeFrame(&vf);
+    }
+    writer.close();
+
+    printf("%s\n", accel.getStats()->toJson().c_str());
+
+    if (checkCache(infile) != 0) {
+        printf("VFrameCache check failed!\n");
+        return -1;
+    }
+    if (checkShard(infile) != 0) {
+        printf("VShardReader check failed!\n");
+        return -1;
+    }
+    if (checkLoader(infile) != 0) {
+        printf("VLoader check failed!\n");
+        return -1;
     }
 
     printf("test done!\n");
@@ -0,0 +1,64 @@
+#include "threadpool.hpp"
+
+VThreadPool::VThreadPool(int threads)
+{
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+
+    for (int i = 0; i < threads; i++)
+        workers_.push_back(std::thread(&VThreadPool::workerLoop, this));
+}
+
+VThreadPool::~VThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    taskCv_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++)
+        workers_[i].join();
+}
+
+void VThreadPool::submit(const std::function<void()>& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(task);
+    }
+    taskCv_.notify_one();
+}
+
+void VThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    idleCv_.wait(lock, [this] { return tasks_.empty() && active_ == 0; });
+}
+
+void VThreadPool::workerLoop()
+{
+    std::function<void()> task;
+
+    while (1) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            taskCv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty())
+                return;
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+            active_++;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            active_--;
+            if (tasks_.empty() && active_ == 0)
+                idleCv_.notify_all();
+        }
+    }
+}
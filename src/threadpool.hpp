@@ -0,0 +1,33 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from one FIFO queue.
+class VThreadPool
+{
+public:
+    explicit VThreadPool(int threads=0);
+    ~VThreadPool();
+
+    void submit(const std::function<void()>& task);
+    // block until the queue is empty and no task is running
+    void wait();
+    int size() { return (int)workers_.size(); }
+
+private:
+    void workerLoop();
+
+private:
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable taskCv_;
+    std::condition_variable idleCv_;
+    int active_ = 0;
+    bool stop_ = false;
+};
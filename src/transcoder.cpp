@@ -0,0 +1,82 @@
+#include "transcoder.hpp"
+#include <string.h>
+
+VTranscoder::VTranscoder(const char* inf, const char* outf, const char* type) :
+    infile_(inf),
+    outfile_(outf),
+    vatype_(type)
+{
+}
+
+VTranscoder::~VTranscoder()
+{
+    /* the encoder may still hold surfaces of the decoder's device */
+    encoder_.reset();
+    decoder_.reset();
+    av_buffer_unref(&hwDeviceCtx_);
+}
+
+int VTranscoder::init(const VTranscodeOptions& opts)
+{
+    VAccelOptions dec;
+    VEncoderOptions enc = opts.encoder;
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+
+    sw_ = !strcmp(vatype_, "sw");
+    if (!sw_) {
+        type = av_hwdevice_find_type_by_name(vatype_);
+        if (type == AV_HWDEVICE_TYPE_NONE ||
+            av_hwdevice_ctx_create(&hwDeviceCtx_, type, NULL, NULL, 0) < 0) {
+            fprintf(stderr, "No %s device, transcoding in software\n", vatype_);
+            sw_ = true;
+        }
+    }
+
+    /* decoded, scaled and encoded surfaces all belong to the one device */
+    dec.hwDevice = hwDeviceCtx_;
+    dec.onDevice = !sw_;
+    dec.outWidth = opts.width;
+    dec.outHeight = opts.height;
+    dec.pipelined = opts.pipelined;
+    /* surfaces waiting in the encoder's queue, plus the ones it is encoding */
+    dec.extraSurfaces = enc.inFlight + enc.maxBFrames + 2;
+
+    decoder_.reset(new VAccel(infile_, "out.yuv", sw_ ? "sw" : vatype_));
+    if (decoder_->init(dec) < 0)
+        return -1;
+    if (!decoder_->isHardware())
+        sw_ = true;
+
+    /* an encoder on the CPU downloads the surfaces itself, once */
+    enc.hwDevice = hwDeviceCtx_;
+    encoder_.reset(new VEncoder(outfile_, sw_ ? "sw" : vatype_));
+    if (encoder_->init(enc) < 0)
+        return -1;
+
+    return 0;
+}
+
+int VTranscoder::run()
+{
+    AVFrame *frame = nullptr;
+    int ret = 0, closed = 0;
+
+    if (!decoder_ || !encoder_)
+        return AVERROR(EINVAL);
+    if (!(frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    while ((ret = decoder_->getSurface(frame)) == 0) {
+        ret = encoder_->encode(frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            break;
+    }
+    av_frame_free(&frame);
+
+    closed = encoder_->close();
+    if (ret == AVERROR_EOF)
+        ret = 0;
+
+    return ret < 0 ? ret : closed;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "accel.hpp"
+#include "encoder.hpp"
+
+struct VTranscodeOptions
+{
+    // output size, 0 keeps the decoded size
+    int width = 0;
+    int height = 0;
+    // codec, rate control and frames in flight of the output; hwDevice is
+    // ignored, the transcoder shares its own device
+    VEncoderOptions encoder;
+    // demux, decode and scale on their own threads
+    bool pipelined = false;
+};
+
+// Decode, downscale and re-encode one file. On a device the frames never leave
+// it: VAccel hands out its scale_vaapi surfaces (opts.onDevice) and VEncoder
+// encodes them from the same frames context, so the decoder, scaler and encoder
+// share one device and nothing is copied to the host. Without a device (or with
+// type "sw") the chain is software decode, swscale (VFilter) and libx264.
+class VTranscoder
+{
+public:
+    VTranscoder(const char* inf, const char* outf, const char* type="vaapi");
+    ~VTranscoder();
+
+    int init(const VTranscodeOptions& opts = VTranscodeOptions());
+    // transcode to the end of the input, returns 0 or the first error
+    int run();
+    bool isHardware() { return !sw_; }
+    int64_t getFrameCount() { return encoder_ ? encoder_->getFrameCount() : 0; }
+
+    VAccel* getDecoder() { return decoder_.get(); }
+    VEncoder* getEncoder() { return encoder_.get(); }
+
+private:
+    const char* infile_;
+    const char* outfile_;
+    const char* vatype_;
+    AVBufferRef *hwDeviceCtx_ = nullptr;
+    bool sw_ = false;
+    std::unique_ptr<VAccel> decoder_;
+    std::unique_ptr<VEncoder> encoder_;
+};
@@ -0,0 +1,199 @@
+#include "writer.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+VWriter::VWriter(const char* path, size_t bufSize, bool direct) :
+    path_(path),
+    bufSize_((bufSize + align_ - 1) / align_ * align_),
+    direct_(direct)
+{
+}
+
+VWriter::~VWriter()
+{
+    close();
+    free(bufs_[0]);
+    free(bufs_[1]);
+}
+
+int VWriter::open()
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    /* already open, the writer thread is still running */
+    if (fd_ >= 0)
+        return AVERROR(EINVAL);
+
+    if (direct_)
+        flags |= O_DIRECT;
+    if ((fd_ = ::open(path_.c_str(), flags, 0644)) < 0) {
+        fprintf(stderr, "Cannot open output file %s\n", path_.c_str());
+        return AVERROR(errno);
+    }
+
+    /* buffers of an earlier open() are reused, they are freed by the destructor */
+    for (int i = 0; i < 2; i++) {
+        if (!bufs_[i] && posix_memalign((void**)&bufs_[i], align_, bufSize_) != 0) {
+            /* no writer thread yet, close() must see a closed writer */
+            bufs_[i] = nullptr;
+            ::close(fd_);
+            fd_ = -1;
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    /* close() left stop_ set, and may have returned on an earlier error */
+    cur_ = 0;
+    fill_ = 0;
+    pending_ = -1;
+    pendingSize_ = 0;
+    stop_ = false;
+    error_ = 0;
+    written_ = 0;
+
+    thread_ = std::thread(&VWriter::writerLoop, this);
+    return 0;
+}
+
+int VWriter::write(const uint8_t* data, size_t size)
+{
+    int ret = 0;
+
+    if (fd_ < 0)
+        return AVERROR(EINVAL);
+
+    while (size > 0) {
+        size_t n = bufSize_ - fill_;
+        if (n > size)
+            n = size;
+
+        memcpy(bufs_[cur_] + fill_, data, n);
+        fill_ += n;
+        data += n;
+        size -= n;
+
+        if (fill_ == bufSize_ && (ret = submit()) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int VWriter::writeFrame(VFrame* f)
+{
+    int ret = 0;
+
+    for (int p = 0; p < f->getPlaneCount(); p++) {
+        int h = f->getPlaneHeight(p);
+        int bytes = f->getRowBytes(p);
+        /* unpadded planes go out in one piece, padded ones row by row */
+        if (f->getLinesize(p) == bytes) {
+            if ((ret = write(f->getData(p), (size_t)bytes * h)) < 0)
+                return ret;
+            continue;
+        }
+        for (int y = 0; y < h; y++) {
+            if ((ret = write(f->getData(p) + y * f->getLinesize(p), bytes)) < 0)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+int VWriter::submit()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    /* with two buffers, the writer being idle means the other one is free */
+    cv_.wait(lock, [this] { return pending_ < 0; });
+    if (error_ < 0)
+        return error_;
+
+    pending_ = cur_;
+    pendingSize_ = fill_;
+    cv_.notify_all();
+
+    cur_ ^= 1;
+    fill_ = 0;
+    return 0;
+}
+
+int VWriter::close()
+{
+    int ret = 0;
+
+    if (fd_ < 0)
+        return error_;
+
+    if (fill_ > 0)
+        ret = submit();
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return pending_ < 0; });
+        stop_ = true;
+        cv_.notify_all();
+    }
+    if (thread_.joinable())
+        thread_.join();
+
+    ::close(fd_);
+    fd_ = -1;
+    return (ret < 0) ? ret : error_;
+}
+
+int64_t VWriter::getBytesWritten()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return written_;
+}
+
+void VWriter::writerLoop()
+{
+    while (1) {
+        int idx = -1;
+        size_t size = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || pending_ >= 0; });
+            if (pending_ < 0)
+                return;
+            idx = pending_;
+            size = pendingSize_;
+        }
+
+        /* only the final tail can be unaligned, O_DIRECT would reject it */
+        if (direct_ && (size % align_))
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+
+        int err = 0;
+        for (size_t done = 0; done < size; ) {
+            ssize_t n = ::write(fd_, bufs_[idx] + done, size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                err = AVERROR(errno ? errno : EIO);
+                fprintf(stderr, "Failed to write %s\n", path_.c_str());
+                break;
+            }
+            done += n;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (err >= 0)
+            written_ += size;
+        else if (error_ == 0)
+            error_ = err;
+        pending_ = -1;
+        cv_.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "frame.hpp"
+
+// Raw frame sink that keeps its file open and batches writes. Data is gathered
+// in one of two aligned buffers while a writer thread flushes the other, so the
+// decode thread never waits on a write() syscall unless the disk falls behind.
+// With direct set the file is opened O_DIRECT (buffers are page aligned and a
+// multiple of 4 KiB; only the final tail is written buffered).
+class VWriter
+{
+public:
+    VWriter(const char* path="out.yuv", size_t bufSize=8 << 20, bool direct=false);
+    ~VWriter();
+
+    // truncates path; fails with EINVAL while open. A closed writer can be
+    // opened again and starts over with the same buffers
+    int open();
+    int write(const uint8_t* data, size_t size);
+    // planes of f, row by row without padding (same bytes as VFrame::saveFile)
+    int writeFrame(VFrame* f);
+    // flush the last buffer, join the writer thread, returns the first error
+    int close();
+
+    int64_t getBytesWritten();
+
+private:
+    int submit();
+    void writerLoop();
+
+private:
+    static const size_t align_ = 4096;
+
+    std::string path_;
+    size_t bufSize_;
+    bool direct_;
+    int fd_ = -1;
+    uint8_t *bufs_[2] = {};
+    int cur_ = 0;
+    size_t fill_ = 0;
+    int64_t written_ = 0;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int pending_ = -1;
+    size_t pendingSize_ = 0;
+    bool stop_ = false;
+    int error_ = 0;
+};
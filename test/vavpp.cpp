@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <string.h>
+#include <thread>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -6,8 +8,225 @@ extern "C" {
 #include <libavutil/hwcontext.h>
 }
 
+#include "processor.hpp"
+#include "writer.hpp"
+
+// vavpp <vaapi|sw> <input>: decode and feed every frame, surfaces as they are,
+// to one VProcessor with three outputs written to vpp_<n>.yuv. A second,
+// single threaded VProcessor gets the same frames; the banded outputs must
+// match it byte for byte
+
+static const int outputCount = 3;
+static enum AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
+
+static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
+{
+    const enum AVPixelFormat *p;
+
+    for (p = pix_fmts; *p != -1; p++) {
+        if (*p == hw_pix_fmt)
+            return *p;
+    }
+
+    fprintf(stderr, "Failed to get HW surface format.\n");
+    return AV_PIX_FMT_NONE;
+}
+
+static bool sameFrame(VFrame* a, VFrame* b)
+{
+    if (a->getWidth() != b->getWidth() || a->getHeight() != b->getHeight() ||
+        a->getFormat() != b->getFormat())
+        return false;
+    for (int p = 0; p < a->getPlaneCount(); p++) {
+        for (int y = 0; y < a->getPlaneHeight(p); y++) {
+            if (memcmp(a->getData(p) + y * a->getLinesize(p), b->getData(p) + y * b->getLinesize(p),
+                       a->getRowBytes(p)))
+                return false;
+        }
+    }
+    return true;
+}
+
+static int decode_process(AVCodecContext *avctx, AVPacket *packet, VProcessor *vpp,
+                          VProcessor *vppOne, VFrame *outs, VFrame *outsOne, VWriter **writers,
+                          int *mismatches)
+{
+    AVFrame *frame = nullptr;
+    int ret = 0;
+
+    ret = avcodec_send_packet(avctx, packet);
+    if (ret < 0) {
+        fprintf(stderr, "Error during decoding\n");
+        return ret;
+    }
+
+    if (!(frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    while (1) {
+        ret = avcodec_receive_frame(avctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            ret = 0;
+            break;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error while decoding\n");
+            break;
+        }
+
+        ret = vpp->process(frame, outs);
+        if (ret >= 0)
+            ret = vppOne->process(frame, outsOne);
+        av_frame_unref(frame);
+        if (ret < 0) {
+            fprintf(stderr, "Error while processing\n");
+            break;
+        }
+        for (int i = 0; i < outputCount; i++) {
+            writers[i]->writeFrame(&outs[i]);
+            if (!sameFrame(&outs[i], &outsOne[i]))
+                mismatches[i]++;
+        }
+    }
+
+    av_frame_free(&frame);
+    return ret;
+}
+
 int main(int argc, char** argv)
 {
+    int video_stream = -1;
+    AVBufferRef *hw_device_ctx = nullptr;
+    AVFormatContext *input_ctx = nullptr;
+    AVCodecContext *decoder_ctx = nullptr;
+    AVCodec *decoder = nullptr;
+    AVPacket packet = {};
+    enum AVHWDeviceType type = AV_HWDEVICE_TYPE_NONE;
+    VWriter *writers[outputCount] = {};
+    VFrame outs[outputCount];
+    VFrame outsOne[outputCount];
+    int mismatches[outputCount] = {};
+    bool same = true;
+    int ret = 0;
+
+    if (argc != 3)
+        return -1;
+
+    const char* hwtype = argv[1];
+    const char* infile = argv[2];
+
+    /* an archive copy, a detector input and a classifier crop of the centre */
+    std::vector<VOutputSpec> specs(outputCount);
+    specs[1].width = 640;
+    specs[1].height = 360;
+    specs[2].width = 224;
+    specs[2].height = 224;
+
+    if (strcmp(hwtype, "sw")) {
+        type = av_hwdevice_find_type_by_name(hwtype);
+        if (type == AV_HWDEVICE_TYPE_NONE)
+            return -1;
+    }
+
+    if ( avformat_open_input(&input_ctx, infile, nullptr, nullptr) != 0) {
+        fprintf(stderr, "Cannot open input file %s\n", infile);
+        return -1;
+    }
+
+    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
+        fprintf(stderr, "Cannot find input stream information.\n");
+        return -1;
+    }
+
+    video_stream = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    if (video_stream < 0) {
+        fprintf(stderr, "Cannot find a video stream in the input file\n");
+        return -1;
+    }
+
+    for (int i = 0; type != AV_HWDEVICE_TYPE_NONE; i++) {
+        const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
+        if (!config) {
+            fprintf(stderr, "Decoder %s does not support device type %s.\n",
+                    decoder->name, av_hwdevice_get_type_name(type));
+            return -1;
+        }
+        if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
+            config->device_type == type) {
+            hw_pix_fmt = config->pix_fmt;
+            break;
+        }
+    }
+
+    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
+        return AVERROR(ENOMEM);
+
+    if (avcodec_parameters_to_context(decoder_ctx, input_ctx->streams[video_stream]->codecpar) < 0)
+        return -1;
+
+    if (type != AV_HWDEVICE_TYPE_NONE) {
+        decoder_ctx->get_format  = get_hw_format;
+        if (av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) < 0) {
+            fprintf(stderr, "Failed to create specified HW device.\n");
+            return -1;
+        }
+        decoder_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+    }
+
+    if (avcodec_open2(decoder_ctx, decoder, NULL) < 0) {
+        fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
+        return -1;
+    }
+
+    /* the crop is only known once the frame size is */
+    specs[2].crop.width = FFMIN(decoder_ctx->width, decoder_ctx->height);
+    specs[2].crop.height = specs[2].crop.width;
+    specs[2].crop.x = (decoder_ctx->width - specs[2].crop.width) / 2;
+    specs[2].crop.y = (decoder_ctx->height - specs[2].crop.height) / 2;
+    /* at least a few bands per output, also on a small machine */
+    VProcessor vpp(specs, FFMAX(4, (int)std::thread::hardware_concurrency()));
+    VProcessor vppOne(specs, 1);
+
+    for (int i = 0; i < outputCount; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "vpp_%d.yuv", i);
+        writers[i] = new VWriter(name);
+        if (writers[i]->open() != 0)
+            return -1;
+    }
+
+    while (ret >= 0) {
+        if ((ret = av_read_frame(input_ctx, &packet)) < 0)
+            break;
+
+        if (video_stream == packet.stream_index)
+            ret = decode_process(decoder_ctx, &packet, &vpp, &vppOne, outs, outsOne, writers,
+                                 mismatches);
+
+        av_packet_unref(&packet);
+    }
+
+    packet.data = NULL;
+    packet.size = 0;
+    ret = decode_process(decoder_ctx, &packet, &vpp, &vppOne, outs, outsOne, writers,
+                                 mismatches);
+    av_packet_unref(&packet);
+    for (int i = 0; i < outputCount; i++) {
+        writers[i]->close();
+        delete writers[i];
+    }
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+    av_buffer_unref(&hw_device_ctx);
+
+    /* device outputs should be mapped, a download means the map path broke */
+    printf("outputs mapped %lld, downloaded %lld\n", (long long)vpp.getMappedOutputs(),
+           (long long)vpp.getDownloadedOutputs());
+    for (int i = 0; i < outputCount; i++) {
+        if (mismatches[i]) {
+            fprintf(stderr, "output %d differs from a single thread in %d frames\n", i, mismatches[i]);
+            same = false;
+        }
+    }
     printf("va processor done!\n");
-    return 0;
-}
\ No newline at end of file
+    return same ? 0 : -1;
+}